@@ -0,0 +1,242 @@
+// Steven Culwell
+// 1001783662
+
+// Benchmark driver for the filesystem. Times put and get across a range of
+// file sizes, and list, df, open and savefs on empty and full images, then
+// writes one line of results per benchmark to the file given on the command
+// line (bench_output.txt by default):
+//
+//   op,file_size,image,count,ops_per_sec,p50_us,p90_us,p99_us,max_us
+//
+// Everything runs in a temporary directory that is removed afterwards.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "filesystem.h"
+
+#define IMAGE_NAME      "bench.img"
+#define MAX_FILES       125
+#define MAX_FILE_SIZE   10240000
+
+// Number of times each operation is timed
+#define PUT_GET_OPS     200
+#define OPEN_OPS        20
+#define LIST_OPS        1000
+#define DF_OPS          100000
+#define SAVEFS_OPS      100
+
+static FILE *results;
+
+// Latencies of the operation being measured, in nanoseconds
+static uint64_t *samples;
+static int num_samples;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_samples(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+// Return the latency below which percent percent of the samples fall, in microseconds
+static double percentile(double percent) {
+  int idx = (int) (percent / 100 * num_samples);
+  if(idx >= num_samples)
+    idx = num_samples - 1;
+  return samples[idx] / 1000.0;
+}
+
+// Write a line of results for the samples taken for op, then clear them
+static void report(char *op, int file_size, char *image) {
+  if(num_samples == 0)
+    return;
+
+  uint64_t total = 0;
+  for(int i = 0; i < num_samples; i++)
+    total += samples[i];
+  qsort(samples, num_samples, sizeof(uint64_t), compare_samples);
+
+  fprintf(results, "%s,%d,%s,%d,%.1f,%.2f,%.2f,%.2f,%.2f\n", op, file_size, image,
+      num_samples, num_samples / (total / 1e9), percentile(50), percentile(90),
+      percentile(99), samples[num_samples - 1] / 1000.0);
+  fprintf(stderr, "%-12s %9d %-5s %7d ops %12.1f ops/s  p50 %10.2f us  p99 %10.2f us\n", op,
+      file_size, image, num_samples, num_samples / (total / 1e9), percentile(50), percentile(99));
+  num_samples = 0;
+}
+
+// Time a single call of expression, adding it to the samples
+#define TIME(expression) do {                   \
+    uint64_t start = now_ns();                  \
+    expression;                                 \
+    samples[num_samples++] = now_ns() - start;  \
+  } while(0)
+
+// Create a local file named name holding size bytes
+static void make_file(char *name, int size) {
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  char *data = malloc(size > 0 ? size : 1);
+  for(int i = 0; i < size; i++)
+    data[i] = rand();
+  if(fd == -1 || write(fd, data, size) != size) {
+    fprintf(stderr, "bench: could not create %s\n", name);
+    exit(1);
+  }
+  free(data);
+  close(fd);
+}
+
+// Create an empty image and open it
+static mfs_t *new_image() {
+  mfs_createfs(IMAGE_NAME, 0, NULL);
+  return mfs_open(IMAGE_NAME, 0);
+}
+
+// Time put and get of files of size bytes. Each round puts as many files as
+// fit in an empty image, gets each of them back, and deletes them again.
+static void bench_put_get(int size) {
+  mfs_t *h = new_image();
+  int per_round = MAX_FILES;
+  if(size > 0 && mfs_df(h) / size < per_round)
+    per_round = mfs_df(h) / size;
+
+  char names[MAX_FILES][16];
+  for(int i = 0; i < per_round; i++) {
+    sprintf(names[i], "f%d", i);
+    make_file(names[i], size);
+  }
+
+  uint64_t *get_samples = malloc(PUT_GET_OPS * sizeof(uint64_t));
+  int num_get_samples = 0;
+  while(num_samples < PUT_GET_OPS) {
+    int count = per_round;
+    if(count > PUT_GET_OPS - num_samples)
+      count = PUT_GET_OPS - num_samples;
+
+    for(int i = 0; i < count; i++)
+      TIME(mfs_put(h, names[i], NULL));
+
+    for(int i = 0; i < count; i++) {
+      uint64_t start = now_ns();
+      mfs_get(h, names[i], "bench.out");
+      get_samples[num_get_samples++] = now_ns() - start;
+    }
+
+    for(int i = 0; i < count; i++)
+      mfs_del(h, names[i]);
+  }
+  report("put", size, "empty");
+
+  memcpy(samples, get_samples, num_get_samples * sizeof(uint64_t));
+  num_samples = num_get_samples;
+  report("get", size, "empty");
+
+  free(get_samples);
+  mfs_close(h);
+  for(int i = 0; i < per_round; i++)
+    unlink(names[i]);
+  unlink("bench.out");
+}
+
+// Time list, df, open and savefs on the image, which is either empty or
+// full as given by image
+static void bench_image_ops(char *image, mfs_t *h) {
+  for(int i = 0; i < LIST_OPS; i++)
+    TIME(mfs_list(h, NULL, true));
+  report("list", 0, image);
+
+  for(int i = 0; i < DF_OPS; i++)
+    TIME(mfs_df(h));
+  report("df", 0, image);
+
+  // Changing an attribute makes savefs commit one block each time
+  char name[] = "f0";
+  for(int i = 0; i < SAVEFS_OPS; i++) {
+    mfs_setattrib(h, name, H, i % 2 == 0);
+    TIME(mfs_savefs(h));
+  }
+  report("savefs", 0, image);
+  mfs_close(h);
+
+  for(int i = 0; i < OPEN_OPS; i++) {
+    TIME(h = mfs_open(IMAGE_NAME, 0));
+    mfs_close(h);
+  }
+  report("open", 0, image);
+
+  for(int i = 0; i < OPEN_OPS; i++) {
+    TIME(h = mfs_open(IMAGE_NAME, FS_MMAP));
+    mfs_close(h);
+  }
+  report("open_mmap", 0, image);
+}
+
+int main(int argc, char *argv[]) {
+  char *output = argc > 1 ? argv[1] : "bench_output.txt";
+  results = fopen(output, "w");
+  if(results == NULL) {
+    perror(output);
+    return 1;
+  }
+  fprintf(results, "op,file_size,image,count,ops_per_sec,p50_us,p90_us,p99_us,max_us\n");
+
+  char dir_name[] = "bench.XXXXXX";
+  if(mkdtemp(dir_name) == NULL || chdir(dir_name) == -1) {
+    perror("bench");
+    return 1;
+  }
+
+  // The filesystem reports every operation on stdout, which would
+  // drown out the results
+  fflush(stdout);
+  freopen("/dev/null", "w", stdout);
+  samples = malloc(DF_OPS * sizeof(uint64_t));
+
+  int sizes[] = { 1, 1024, 65536, 1048576, MAX_FILE_SIZE };
+  for(int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    bench_put_get(sizes[i]);
+
+  // An empty image, apart from the file savefs changes an attribute of
+  mfs_t *h = new_image();
+  make_file("f0", 1);
+  mfs_put(h, "f0", NULL);
+  mfs_savefs(h);
+  bench_image_ops("empty", h);
+
+  // A full image, with every inode used and the data blocks split between them.
+  // The first save of the full image commits every block.
+  h = new_image();
+  int size = mfs_df(h) / MAX_FILES - 8192;
+  for(int i = 0; i < MAX_FILES; i++) {
+    char name[16];
+    sprintf(name, "f%d", i);
+    make_file(name, size);
+    mfs_put(h, name, NULL);
+    unlink(name);
+  }
+  TIME(mfs_savefs(h));
+  report("savefs_all", size, "full");
+  bench_image_ops("full", h);
+
+  unlink("f0");
+  unlink(IMAGE_NAME);
+  unlink(IMAGE_NAME ".journal");
+  chdir("..");
+  rmdir(dir_name);
+
+  fclose(results);
+  free(samples);
+  return 0;
+}
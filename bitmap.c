@@ -0,0 +1,97 @@
+// Steven Culwell
+// 1001783662
+
+#include "bitmap.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITMAP_HAVE_AVX2
+#endif
+
+// Return the index of the first nonzero word in words[from, to), or -1
+static int find_nonzero_word(const uint64_t *words, int from, int to) {
+  for(int i = from; i < to; i++)
+    if(words[i])
+      return i;
+  return -1;
+}
+
+#ifdef BITMAP_HAVE_AVX2
+// Same as find_nonzero_word, but skips over 256 bits of zeros at a time
+__attribute__((target("avx2")))
+static int find_nonzero_word_avx2(const uint64_t *words, int from, int to) {
+  int i = from;
+  for(; i + 4 <= to; i += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) &words[i]);
+    if(!_mm256_testz_si256(v, v))
+      break;
+  }
+  return find_nonzero_word(words, i, to);
+}
+#endif
+
+static int (*scan)(const uint64_t *, int, int) = find_nonzero_word;
+
+// Pick the AVX2 scan if the CPU we are running on supports it before main
+// runs, so that it never changes while threads are searching bitmaps
+__attribute__((constructor))
+static void select_find_nonzero_word(void) {
+#ifdef BITMAP_HAVE_AVX2
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    scan = find_nonzero_word_avx2;
+#endif
+}
+
+void bitmap_set_range(uint64_t *map, int start, int count) {
+  for(int i = start; i < start + count; i++)
+    bitmap_set(map, i);
+}
+
+int bitmap_find_next(const uint64_t *map, int nbits, int start) {
+  if(start < 0)
+    start = 0;
+  if(start >= nbits)
+    return -1;
+
+  // Mask off the bits before start in the first word, then
+  // move on to scanning whole words if none are left
+  int word_idx = start / 64;
+  uint64_t word = map[word_idx] & (~UINT64_C(0) << (start % 64));
+  if(!word) {
+    word_idx = scan(map, word_idx + 1, BITMAP_WORDS(nbits));
+    if(word_idx == -1)
+      return -1;
+    word = map[word_idx];
+  }
+
+  int bit = word_idx * 64 + __builtin_ctzll(word);
+  return bit < nbits ? bit : -1;
+}
+
+int bitmap_find_next_zero(const uint64_t *map, int nbits, int start) {
+  if(start < 0)
+    start = 0;
+  if(start >= nbits)
+    return -1;
+
+  int word_idx = start / 64;
+  uint64_t word = ~map[word_idx] & (~UINT64_C(0) << (start % 64));
+  while(!word) {
+    if(++word_idx >= BITMAP_WORDS(nbits))
+      return -1;
+    word = ~map[word_idx];
+  }
+
+  int bit = word_idx * 64 + __builtin_ctzll(word);
+  return bit < nbits ? bit : -1;
+}
+
+int bitmap_count(const uint64_t *map, int nbits) {
+  int count = 0;
+  for(int i = 0; i < nbits / 64; i++)
+    count += __builtin_popcountll(map[i]);
+  if(nbits % 64)
+    count += __builtin_popcountll(map[nbits / 64] & ((UINT64_C(1) << (nbits % 64)) - 1));
+  return count;
+}
@@ -0,0 +1,39 @@
+#ifndef CSE3320_BITMAP_H
+#define CSE3320_BITMAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Number of 64 bit words needed to hold a bitmap of nbits bits
+#define BITMAP_WORDS(nbits) (((nbits) + 63) / 64)
+
+// Return true if bit is set in map
+static inline bool bitmap_test(const uint64_t *map, int bit) {
+  return (map[bit / 64] >> (bit % 64)) & 1;
+}
+
+// Set bit in map to 1
+static inline void bitmap_set(uint64_t *map, int bit) {
+  map[bit / 64] |= UINT64_C(1) << (bit % 64);
+}
+
+// Set bit in map to 0
+static inline void bitmap_clear(uint64_t *map, int bit) {
+  map[bit / 64] &= ~(UINT64_C(1) << (bit % 64));
+}
+
+// Set count bits in map to 1, starting at bit start
+void bitmap_set_range(uint64_t *map, int start, int count);
+
+// Return the index of the first set bit in map that is at or after
+// start and before nbits, or -1 if there is none
+int bitmap_find_next(const uint64_t *map, int nbits, int start);
+
+// Return the index of the first clear bit in map that is at or after
+// start and before nbits, or -1 if there is none
+int bitmap_find_next_zero(const uint64_t *map, int nbits, int start);
+
+// Return the number of set bits in the first nbits bits of map
+int bitmap_count(const uint64_t *map, int nbits);
+
+#endif
@@ -0,0 +1,136 @@
+// Steven Culwell
+// 1001783662
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42
+#endif
+
+// Reversed CRC32C polynomial
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc32c_table[256];
+
+// Continue the checksum a byte at a time through crc32c_table
+static uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+  const uint8_t *p = buf;
+  crc = ~crc;
+  while(len--)
+    crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+// The crc32 instruction takes a few cycles before its result can be used
+// again, but can start a new one every cycle. Long buffers are split into
+// three lanes of CRC32C_LONG or CRC32C_SHORT bytes that are checksummed side
+// by side, and the three checksums are then joined together.
+#define CRC32C_LONG  1024
+#define CRC32C_SHORT 128
+
+// Tables that move a checksum past CRC32C_LONG and CRC32C_SHORT zero bytes,
+// one for each byte of the checksum
+static uint32_t crc32c_long_table[4][256];
+static uint32_t crc32c_short_table[4][256];
+
+// Fill table so that it moves a checksum past len zero bytes. Moving past
+// zeros is linear, so only the result for each single bit of the checksum
+// has to be worked out, and every other value is a combination of them.
+static void build_shift_table(uint32_t table[4][256], int len) {
+  uint32_t bits[32];
+  for(int i = 0; i < 32; i++) {
+    uint32_t crc = UINT32_C(1) << i;
+    for(int j = 0; j < len; j++)
+      crc = crc32c_table[crc & 0xff] ^ (crc >> 8);
+    bits[i] = crc;
+  }
+  
+  for(int byte = 0; byte < 4; byte++) {
+    for(int value = 0; value < 256; value++) {
+      uint32_t crc = 0;
+      for(int bit = 0; bit < 8; bit++) {
+        if(value & (1 << bit))
+          crc ^= bits[byte * 8 + bit];
+      }
+      table[byte][value] = crc;
+    }
+  }
+}
+
+// Move crc past the number of zero bytes table was built for
+static inline uint32_t shift_crc(uint32_t table[4][256], uint32_t crc) {
+  return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^
+    table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+// Continue crc over *p, which must be 8 byte aligned, three lanes of lane
+// bytes at a time for as long as there are enough bytes left, moving *p
+// and *len past them
+__attribute__((target("sse4.2")))
+static uint64_t crc32c_lanes(uint64_t crc, const uint8_t **p, size_t *len, size_t lane,
+    uint32_t table[4][256]) {
+  for(; *len >= 3 * lane; *len -= 3 * lane, *p += 3 * lane) {
+    const uint64_t *lane0 = (const uint64_t *) *p;
+    const uint64_t *lane1 = lane0 + lane / 8;
+    const uint64_t *lane2 = lane1 + lane / 8;
+    uint64_t crc1 = 0;
+    uint64_t crc2 = 0;
+    for(size_t i = 0; i < lane / 8; i++) {
+      crc  = _mm_crc32_u64(crc,  lane0[i]);
+      crc1 = _mm_crc32_u64(crc1, lane1[i]);
+      crc2 = _mm_crc32_u64(crc2, lane2[i]);
+    }
+    crc = shift_crc(table, crc) ^ crc1;
+    crc = shift_crc(table, crc) ^ crc2;
+  }
+  return crc;
+}
+
+// Same as crc32c_sw, but with the crc32 instruction of SSE4.2, which
+// computes CRC32C directly, 8 bytes at a time
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len) {
+  const uint8_t *p = buf;
+  uint64_t c = ~crc;
+  for(; len > 0 && (uintptr_t) p % 8 != 0; len--)
+    c = _mm_crc32_u8(c, *p++);
+  
+  c = crc32c_lanes(c, &p, &len, CRC32C_LONG, crc32c_long_table);
+  c = crc32c_lanes(c, &p, &len, CRC32C_SHORT, crc32c_short_table);
+  for(; len >= 8; len -= 8, p += 8)
+    c = _mm_crc32_u64(c, *(const uint64_t *) p);
+  while(len--)
+    c = _mm_crc32_u8(c, *p++);
+  return ~(uint32_t) c;
+}
+#endif
+
+static uint32_t (*crc32c_impl)(uint32_t, const void *, size_t) = crc32c_sw;
+
+// Fill in crc32c_table and pick the SSE4.2 version if the CPU we are running
+// on supports it before main runs, so that neither ever has to be checked
+// when a checksum is computed
+__attribute__((constructor))
+static void build_crc32c_table(void) {
+  for(uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for(int bit = 0; bit < 8; bit++)
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    crc32c_table[i] = crc;
+  }
+  
+#ifdef CRC32C_HAVE_SSE42
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse4.2")) {
+    build_shift_table(crc32c_long_table, CRC32C_LONG);
+    build_shift_table(crc32c_short_table, CRC32C_SHORT);
+    crc32c_impl = crc32c_sse42;
+  }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+  return crc32c_impl(crc, buf, len);
+}
@@ -0,0 +1,11 @@
+#ifndef CSE3320_CRC32C_H
+#define CSE3320_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Continue the CRC32C (Castagnoli) checksum crc over len bytes of buf.
+// Start a new checksum with a crc of 0.
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
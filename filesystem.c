@@ -5,690 +5,4114 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <time.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <libgen.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fnmatch.h>
 #include "filesystem.h"
+#include "bitmap.h"
+#include "journal.h"
+#include "crc32c.h"
+#include "io.h"
+#include "stats.h"
+#include "lz.h"
 
-#define BLOCK_SIZE      8192
+// Geometry of images created without asking for any other
+#define DEFAULT_BLOCK_SIZE 8192
+#define DEFAULT_NUM_BLOCKS 4226
+#define DEFAULT_MAX_FILES  125
 
-#define NUM_DATA_BLOCKS 1250
-#define NUM_BLOCKS      4226
+// Block sizes an image can be created with. Each must be a power of two.
+#define MIN_BLOCK_SIZE  1024
+#define MAX_BLOCK_SIZE  65536
 
-#define MAX_FILENAME    32
-#define MAX_FILES       125
-#define MAX_FILE_SIZE   BLOCK_SIZE*NUM_DATA_BLOCKS
+// Most blocks an image can have, which keeps every block number and bit
+// of the free block map within an int
+#define MAX_NUM_BLOCKS  (1 << 30)
 
-typedef uint8_t inode_ptr;
-typedef uint16_t block_ptr;
+// Number of extents the root of the extent tree of a file holds in its
+// inode, and the most levels of nodes the tree can grow below its root
+#define INODE_EXTENTS   4
+#define MAX_EXTENT_DEPTH 4
+
+// Bytes each inode takes up in the inode table of its group, with as many
+// packed into each block as fit. Must be at least sizeof(inode).
+#define INODE_SIZE      256
+
+// Longest name of a file or directory. A path holds any number of names,
+// separated by '/'.
+#define MAX_FILENAME    255
+
+// Most levels of nodes the B+tree of a directory can have below its root
+#define MAX_DIR_DEPTH   8
+
+// The inode of the root directory, which every path starts from
+#define ROOT_INODE      0
+
+// Once this many blocks are waiting in the journal, they are written back
+// into the image and the journal is emptied
+#define JOURNAL_CHECKPOINT_BLOCKS 1024
+
+// Most threads putdir and getall copy files with at once
+#define MAX_WORKERS     16
+
+// Size of the header and data blocks of a tar archive
+#define TAR_BLOCK_SIZE  512
+
+// Number of blocks of a file put in dedup or compress mode that are looked
+// up or allocated together while the dedup index is locked
+#define STORE_BATCH_BLOCKS 32
+
+// Files put in compress mode are compressed in chunks of this many bytes.
+// Each chunk is stored as a 32 bit header holding its compressed size,
+// followed by the compressed data. Chunks that don't get any smaller are
+// stored as they are, with CHUNK_RAW set in their header.
+#define COMPRESS_CHUNK_SIZE 65536
+#define CHUNK_RAW       0x80000000u
+
+#define FS_MAGIC        0x7f53464d  // "MFS\x7f" in little endian, which can't be part of a filename
+#define FS_VERSION      8
+
+typedef uint32_t inode_ptr;
+typedef uint32_t block_ptr;
 
 typedef struct {
-  int used_blocks;                    // Counts number of used blocks for the inode
-  uint32_t bytes;                     // Total size of the file in bytes
-  uint8_t attrib;                     // Bit field containing bit for each attribute
+  uint64_t file_block;                // The block of the file the extent starts at
+  block_ptr start;                    // The first block of the extent
+  uint32_t length;                    // The number of consecutive blocks in the extent
+} extent;
+
+// Entry of an index node of an extent tree, pointing to the node below it
+typedef struct {
+  uint64_t file_block;                // The first block of the file the node below covers
+  block_ptr block;                    // The block holding the node below
+  uint32_t reserved;
+} extent_index;
+
+// The data of a file is mapped by a tree of extents, ordered by the blocks
+// of the file they hold. The root is kept in the inode and holds up to
+// INODE_EXTENTS entries. Every other node takes up a block of its own,
+// filled with as many entries as fit after its header. Leaves (depth 0)
+// hold extents, and the nodes above them hold an extent_index for each
+// node below. Once the root is full, its entries move into a new node
+// below it and the tree grows a level, so finding the block holding any
+// part of a file only takes one node per level.
+typedef struct {
+  uint16_t num_entries;               // Number of entries in use
+  uint16_t depth;                     // 0 for a leaf, else the number of levels below the node
+  uint32_t reserved;
+} extent_node;
+
+typedef struct {
+  extent_node header;
+  extent entries[INODE_EXTENTS];      // Either extents or extent_index entries, as in any node
+} extent_root;
+
+// Inodes are packed INODE_SIZE bytes apart in the inode table of their group
+typedef struct {
+  uint64_t bytes;                     // Total size of the file in bytes
+  uint64_t packed_bytes;              // Size of the compressed chunks of the file, or 0 if
+                                      // the blocks hold the data as it is
   time_t time_added;                  // The time the file was added to the filesystem
-  block_ptr blocks[NUM_DATA_BLOCKS];  // Direct blocks for the inode
+  uint32_t used_blocks;               // Counts number of data blocks used by the file
+  uint32_t num_extents;               // The number of extents in the extent tree
+  uint32_t checksum;                  // CRC32C of the checksums of the blocks of the file
+  uint8_t attrib;                     // Bit field containing bit for each attribute
+  uint8_t flags;                      // Bit field of the INODE_* flags below
+  extent_root root;                   // Root of the extent tree mapping the file data
 } inode;
 
+// Set in the inode of a file whose data is held in the inode itself, in place
+// of the root of its extent tree and in the rest of its slot of the inode
+// table. Files of up to INLINE_DATA_SIZE bytes are kept this way and take no
+// blocks at all.
+#define INODE_INLINE    0b1
+#define INLINE_DATA_SIZE (INODE_SIZE - offsetof(inode, root))
+
+// Set in the inode of a directory, which keeps a dir_header in place of the
+// root of an extent tree
+#define INODE_DIR       0b10
+
+// Kept by a directory inode in place of the root of an extent tree
+typedef struct {
+  block_ptr root;                     // The block holding the root of the B+tree of the directory
+  uint32_t deleted_entries;           // Number of dir entries of deleted files in the tree
+} dir_header;
+
+// Most dir entries of deleted files a directory keeps. A del that goes over
+// it drops entries with prune_deleted_entries, so that deleting files with
+// new names doesn't grow the directory without end.
+#define MAX_DELETED_ENTRIES 64
+
+// Stored at the start of block 0 to describe the image. The geometry is
+// chosen when the image is created, and each region of the image follows
+// the one before it:
+//  - the superblock, in block 0
+//  - the checksum region, holding the CRC32C of each block from data_start on
+//  - the allocation groups, starting at data_start. Each group has as many
+//    blocks as the bits in a block, apart from the last which may have
+//    fewer, and starts with its own free block bitmap, free inode bitmap and
+//    inode table, which packs the inodes of the group INODE_SIZE bytes apart.
+//    The rest of the blocks of the group hold data.
+// Inodes are numbered through the groups in order, group_inodes to a group.
+// The root directory has inode ROOT_INODE, and every other directory is
+// reached from it.
+typedef struct {
+  uint32_t magic;                     // Always FS_MAGIC
+  uint32_t version;                   // Version of the on disk layout, FS_VERSION
+  uint32_t flags;                     // Bit field of the IMAGE_* flags below
+  uint32_t block_size;                // Bytes in each block
+  uint32_t num_blocks;                // Blocks in the image, metadata included
+  uint32_t max_files;                 // Number of inodes
+  uint32_t checksum_start;            // First block of each region
+  uint32_t data_start;
+  uint32_t checksum_blocks;           // Number of blocks in the checksum region
+  uint32_t group_blocks;              // Blocks in each allocation group
+  uint32_t num_groups;
+  uint32_t group_inodes;              // Inodes in each group
+  uint32_t group_meta_blocks;         // Blocks at the start of each group holding its maps and inodes
+  uint32_t group_inode_start;         // Blocks of each group before its inode table
+} superblock;
+
+// Blocks of its group before the free inode bitmap of a group, which takes up
+// the blocks up to its inode table
+#define GROUP_INODE_MAP 1
+
+// Set in the superblock of images created with FS_DEDUP and FS_COMPRESS
+#define IMAGE_DEDUP     0b01
+#define IMAGE_COMPRESS  0b10
+
+// Set in the superblock of every image, which all have a checksum region.
+// open refuses images without it.
+#define IMAGE_CHECKSUMS 0b100
+
+// Each directory is a B+tree of its dir entries ordered by the hash of their
+// filenames, with every node taking up a block of its own. The leaves hold
+// the dir entries and are linked together in order, and the nodes above them
+// hold a dir_index for each node below, so finding a name only reads one
+// node per level. Entries whose names have the same hash sit next to each
+// other, and can run on from one leaf into the next.
+typedef struct {
+  uint16_t num_entries;               // Number of entries in use
+  uint16_t depth;                     // 0 for a leaf, else the number of levels below the node
+  block_ptr next;                     // The next leaf, or 0 for the last leaf and in other nodes
+} dir_node;
+
+// Entry of a node of a directory above its leaves, pointing to the node below
+typedef struct {
+  uint32_t hash;                      // No entry under the node below has a smaller hash
+  block_ptr block;                    // The block holding the node below
+} dir_index;
+
 typedef struct {
-  char filename[MAX_FILENAME];        // The filename of the dir entry
+  uint32_t hash;                      // hash_filename of the filename, which orders the entries
   inode_ptr inode;                    // The corresponding inode of the dir entry
-  bool valid;                         // True if the dir entry is currently being used, else false
+  uint8_t state;                      // One of the ENTRY_* states below
+  char filename[MAX_FILENAME];        // The filename, only terminated when shorter than MAX_FILENAME
 } dir_entry;
 
-static dir_entry *dir_entries[MAX_FILES];
-static inode *inodes[MAX_FILES];
-static uint8_t *free_inode_map;
-static uint8_t *free_block_map;
+// States of a dir entry. A pending entry holds the name of a file that a put
+// is still reading in, and the inode of the deleted file it took the entry
+// from, or NO_INODE.
+#define ENTRY_DELETED   0
+#define ENTRY_VALID     1
+#define ENTRY_PENDING   2
+#define NO_INODE        UINT32_MAX
 
-static uint8_t filesystem[NUM_BLOCKS][BLOCK_SIZE];
+// One allocation group of an opened image. Each group has its own lock, so
+// files being put into different groups take blocks and inodes at once.
+typedef struct {
+  pthread_mutex_t lock;
+  uint64_t *block_map;                // Bitmap with a 1 bit for each free block of the group
+  uint64_t *inode_map;                // Bitmap with a 1 bit for each free inode of the group
+  int first_block;                    // First block of the group, where its block map is
+  int num_blocks;                     // Blocks in the group, its metadata blocks included
+  int first_inode;                    // Index of the first inode of the group
+  int num_inodes;                     // Inodes of the group in use by the image
+  
+  // Number of set bits in block_map and inode_map, kept up to date by
+  // set_block_free and set_inode_free so that they never need to be counted
+  int free_blocks;
+  int free_inodes;
+  
+  // Where the search for the next free block and inode of the group starts.
+  // Each moves past the last allocation so that searches don't rescan used
+  // entries.
+  int block_hint;
+  int inode_hint;
+} alloc_group;
 
-static char *disk_image_name;
+// Everything about one opened image. Each handle owns its own blocks, so
+// any number of images can be open at once.
+//
+// A handle can be used from any number of threads. Locks are always taken
+// in the order they are listed here, and none is held while waiting on an
+// earlier one:
+//  - image_lock is held for reading by every operation, and for writing by
+//    savefs and close, which need the image to stay still while they run
+//  - dir_lock guards every directory and the inodes of the directories.
+//    Lookups hold it for reading, and put, del, undel, mkdir and rmdir hold
+//    it for writing only while they change an entry, not while file data is
+//    copied or while they wait for an inode
+//  - inode_locks guard each inode and the data blocks it owns. get holds the
+//    lock of its inode for reading while copying the data out, so del has
+//    to wait for it before the blocks can be reused. del and rmdir mark the
+//    entry first and let go of dir_lock before they wait. getall and scrub let
+//    go of dir_lock once they have listed the files, and then lock each file
+//    only while they read it
+//  - dedup_lock guards the dedup index. In dedup mode it is also held by
+//    everything that changes which inodes are in use or which blocks a file
+//    references, since any file can share the blocks of any other
+//  - the lock of each allocation group guards its free maps, free counts
+//    and allocation hints, and the reference counts of its blocks. When
+//    more than one group is locked, they are taken in order.
+struct mfs {
+  // The block array of the image. This either points to memory holding the
+  // whole image, or to a private mapping of the image file when opened with
+  // FS_MMAP
+  uint8_t *blocks;
+  
+  char *disk_image_name;
+  
+  // File descriptor of the mapped image file, or -1 if the image is held in memory
+  int image_fd;
+  
+  // Geometry of the image, read from its superblock when it is opened
+  int block_size;
+  int num_blocks;
+  int max_files;
+  int data_start;                     // First block of the first allocation group
+  int node_entries;                   // Entries that fit in an extent tree node taking up a block
+  int dir_leaf_entries;               // Dir entries that fit in a leaf of a directory
+  int dir_node_entries;               // Entries that fit in the other nodes of a directory
+  int group_blocks;
+  int group_inodes;
+  int group_meta_blocks;
+  int group_inode_start;
+  
+  // Where each inode is in the blocks
+  inode **inodes;
+  
+  alloc_group *groups;
+  int num_groups;
+  
+  // Free inodes and blocks of every group together, which put checks a file
+  // against before it takes anything. They are changed with atomic adds by
+  // whichever group lock is held.
+  int free_inode_count;
+  int free_block_count;
+  
+  // The group the next new file has its inode taken from, so that files
+  // being put at the same time go to different groups
+  unsigned next_group;
+  
+  // Number of files referencing each block, counted from the inodes when an
+  // image is opened. Files put in dedup mode can share blocks, so a block is
+  // only free once the last file referencing it is deleted.
+  uint32_t *block_refs;
+  
+  // True if put shares blocks holding the same data between files instead
+  // of storing them again, which is the case for images created with FS_DEDUP
+  bool dedup;
+  
+  // True if put compresses files, for images created with FS_COMPRESS
+  bool compress;
+  
+  // The checksum region, holding the CRC32C of each data block starting from
+  // block data_start. The checksum of a block is set when data is put into
+  // it, and checked whenever the data is read back out.
+  uint32_t *checksums;
+  
+  // In memory index of the data blocks by fingerprint, built by the first put
+  // that needs it. Blocks with the same fingerprint are chained together
+  // through dedup_next.
+  bool dedup_built;
+  int *dedup_heads;                   // First block in each bucket
+  int *dedup_next;                    // Next block in the same bucket, or -1
+  uint64_t *dedup_fingerprints;       // Fingerprint of each block in the index
+  int dedup_mask;                     // Number of buckets minus one
+  uint64_t *dedup_map;                // 1 bit for each block in the index
+  
+  // True for each block that has been modified since the image was last saved
+  bool *dirty_blocks;
+  
+  // The journal next to the image that savefs commits modified blocks to.
+  // The journal file is only created once something is first committed.
+  char *journal_name;
+  int journal_fd;
+  off_t journal_size;                 // Where the next transaction is appended
+  uint64_t journal_sequence;          // Sequence number of the next transaction
+  
+  // True for each block that has been committed to the journal but not yet
+  // written back into the image file
+  bool *journaled_blocks;
+  int journaled_count;
+  
+  pthread_rwlock_t image_lock;
+  pthread_rwlock_t dir_lock;
+  pthread_rwlock_t *inode_locks;       // One for each inode
+  pthread_mutex_t dedup_lock;
+};
 
-static bool opened = false;
+// The image used by the fs_* functions, or NULL if none is open
+static mfs_t *current = NULL;
 
-// Find first index of block marked as "free" (1)
-// in free_block_map
-int find_next_free_block() {
-  for(int i = 0; i < NUM_BLOCKS; i++)
-    if(free_block_map[i])
-      return i;
-  return -1;
+// Return the address of block idx of the image of h
+static inline uint8_t *block_at(mfs_t *h, int idx) {
+  return h->blocks + (size_t) idx * h->block_size;
 }
 
-// Find first index of inode marked as "free" (1)
-// in free_inode_map
-int find_next_free_inode() {
-  for(int i = 0; i < MAX_FILES; i++)
-    if(free_inode_map[i])
-      return i;
-  return -1;
+// Return the index of the block of the image of h containing addr
+static inline int block_index_of(mfs_t *h, void *addr) {
+  return ((uint8_t *) addr - h->blocks) / h->block_size;
 }
 
-// Find first index of directory entry marked as invalid
-// in dir_entries
-int find_next_free_dir_entry() {
-  for(int i = 0; i < MAX_FILES; i++)
-    if(dir_entries[i]->valid == 0)
-      return i;
-  return -1;
+// Return the size of the image of h in bytes
+static inline size_t image_size(mfs_t *h) {
+  return (size_t) h->num_blocks * h->block_size;
 }
 
-// Find directory entry with a certain filename.
-// This dir_entry must also be either valid or indvalid
-// depending on the given "valid" argument
-int find_dir_entry(char *filename, bool valid) {
-  for(int i = 0; i < MAX_FILES; i++)
-    if(strncmp(dir_entries[i]->filename, filename, MAX_FILENAME) == 0 &&
-        dir_entries[i]->valid == valid)
-      return i;
-  return -1;
+// Mark the block containing addr as modified so that the next
+// savefs writes it back to the image file. Inodes under different locks
+// share blocks of the inode table, so the flag is set atomically.
+static void mark_dirty(mfs_t *h, void *addr) {
+  __atomic_store_n(&h->dirty_blocks[block_index_of(h, addr)], true, __ATOMIC_RELAXED);
 }
 
-// Return true if the filename contains only valid characters
-bool valid_filename(char *filename) {
-  int len = strnlen(filename, MAX_FILENAME);
-  for(int i = 0; i < len; i++) {
-    char c = tolower(filename[i]);
-    if(!(c >= 'a' && c <= 'z') && !(c >= '0' && c <= '9') && c != '.') {
-      return false;
-    }
+// Return the allocation group holding block, which must be in one
+static inline alloc_group *block_group(mfs_t *h, int block) {
+  return &h->groups[(block - h->data_start) / h->group_blocks];
+}
+
+// Return the allocation group holding inode idx
+static inline alloc_group *inode_group(mfs_t *h, int idx) {
+  return &h->groups[idx / h->group_inodes];
+}
+
+// Return true if inode idx is marked as free in the inode map of its group
+static bool inode_free(mfs_t *h, int idx) {
+  alloc_group *g = inode_group(h, idx);
+  return bitmap_test(g->inode_map, idx - g->first_inode);
+}
+
+// Set the bit of inode idx in the inode map of its group to free (1) or
+// used (0). The caller must hold the lock of the group.
+static void set_inode_free(mfs_t *h, int idx, bool free) {
+  alloc_group *g = inode_group(h, idx);
+  int bit = idx - g->first_inode;
+  if(bitmap_test(g->inode_map, bit) == free)
+    return;
+  
+  g->free_inodes += free ? 1 : -1;
+  __atomic_fetch_add(&h->free_inode_count, free ? 1 : -1, __ATOMIC_RELAXED);
+  if(free) {
+    bitmap_set(g->inode_map, bit);
+  } else {
+    bitmap_clear(g->inode_map, bit);
+    g->inode_hint = bit + 1;
   }
-  return true;
+  mark_dirty(h, &g->inode_map[bit / 64]);
 }
 
-// Initialize the file system, including dir_entries array, inode
-// array, free_inode_map, free_block_map, and disk_image_name
-int fs_createfs(char *name) {
+// Set the bit of block idx in the block map of its group to free (1) or
+// used (0). The caller must hold the lock of the group.
+static void set_block_free(mfs_t *h, int idx, bool free) {
+  alloc_group *g = block_group(h, idx);
+  int bit = idx - g->first_block;
+  if(bitmap_test(g->block_map, bit) == free)
+    return;
   
-  FILE *ofp;
-  ofp = fopen(name, "w");
+  g->free_blocks += free ? 1 : -1;
+  __atomic_fetch_add(&h->free_block_count, free ? 1 : -1, __ATOMIC_RELAXED);
+  if(free) {
+    bitmap_set(g->block_map, bit);
+  } else {
+    bitmap_clear(g->block_map, bit);
+    g->block_hint = bit + 1;
+  }
+  mark_dirty(h, &g->block_map[bit / 64]);
+}
 
-  if(ofp == NULL) {
-    printf("createfs error: Could not open file \"%s\": ", disk_image_name);
-    fflush(stdout);
-    perror("");
-    return -1;
+// Lock the dedup index, which in dedup mode has to be held while any file
+// takes or drops blocks or inodes
+static inline void lock_dedup(mfs_t *h) {
+  if(h->dedup)
+    pthread_mutex_lock(&h->dedup_lock);
+}
+
+static inline void unlock_dedup(mfs_t *h) {
+  if(h->dedup)
+    pthread_mutex_unlock(&h->dedup_lock);
+}
+
+// Mark count blocks starting at block start as modified
+static void mark_dirty_blocks(mfs_t *h, int start, int count) {
+  memset(&h->dirty_blocks[start], true, count);
+}
+
+// Return the extents held by the leaf n of an extent tree
+static inline extent *node_extents(extent_node *n) {
+  return (extent *) (n + 1);
+}
+
+// Return the entries of the index node n of an extent tree
+static inline extent_index *node_children(extent_node *n) {
+  return (extent_index *) (n + 1);
+}
+
+// Return the most entries the node n of the extent tree of node can hold
+static inline int node_capacity(mfs_t *h, inode *node, extent_node *n) {
+  return n == &node->root.header ? INODE_EXTENTS : h->node_entries;
+}
+
+// A walk through the extents of a file in order. Each node is checked as it
+// is reached, so a tree that has been overwritten since the file was deleted
+// ends the walk instead of leading it into other blocks.
+typedef struct {
+  mfs_t *h;
+  inode *node;
+  bool tree_blocks;                   // True to also visit the blocks holding the nodes
+  int level;                          // Depth of the node being walked
+  extent_node *path[MAX_EXTENT_DEPTH + 1]; // The node being walked at each depth
+  int next[MAX_EXTENT_DEPTH + 1];     // The next entry of each of them
+  uint64_t file_block;                // The block of the file the next extent must start at
+  extent tree_extent;                 // Holds the block of the last node reached
+  int failed_block;                   // The block of the node that ended the walk, or -1
+} extent_walk;
+
+// Return the data of the file node, which must be inline
+static inline uint8_t *inline_data(inode *node) {
+  return (uint8_t *) &node->root;
+}
+
+// Return the dir_header of the directory node
+static inline dir_header *dir_header_of(inode *node) {
+  return (dir_header *) &node->root;
+}
+
+// Return where the directory node keeps the block holding the root of its tree
+static inline block_ptr *dir_root(inode *node) {
+  return &dir_header_of(node)->root;
+}
+
+// Start a walk through the extents of the file node. If tree_blocks is
+// true, the block of each node below the root is visited as an extent of
+// its own before the extents under it. Inline files and directories have
+// no extents.
+static void start_walk(extent_walk *w, mfs_t *h, inode *node, bool tree_blocks) {
+  w->h = h;
+  w->node = node;
+  w->tree_blocks = tree_blocks;
+  w->level = node->root.header.depth;
+  w->file_block = 0;
+  w->failed_block = -1;
+  if(node->flags & (INODE_INLINE | INODE_DIR))
+    return;
+  if(w->level <= MAX_EXTENT_DEPTH && node->root.header.num_entries <= INODE_EXTENTS) {
+    w->path[w->level] = &node->root.header;
+    w->next[w->level] = 0;
+  } else {
+    w->failed_block = block_index_of(h, node);
+  }
+}
+
+// Return true if block is a data block of one of the allocation groups
+// of the image of h, rather than one of their metadata blocks
+static inline bool data_block(mfs_t *h, uint64_t block) {
+  if(block < h->data_start || block >= h->num_blocks)
+    return false;
+  uint64_t offset = block - h->data_start;
+  return offset / h->group_blocks < h->num_groups && offset % h->group_blocks >= h->group_meta_blocks;
+}
+
+// Return true if the length blocks starting at block are all data blocks of
+// the same allocation group, as the blocks of every extent are
+static inline bool data_extent(mfs_t *h, uint64_t block, uint32_t length) {
+  uint64_t last = block + length - 1;
+  return length > 0 && data_block(h, block) && data_block(h, last) &&
+    (block - h->data_start) / h->group_blocks == (last - h->data_start) / h->group_blocks;
+}
+
+// Return the next extent of the walk, or NULL once every extent has been
+// visited or a node turns out to be corrupt, which sets failed_block
+static extent *next_extent(extent_walk *w) {
+  mfs_t *h = w->h;
+  if(w->node->flags & (INODE_INLINE | INODE_DIR))
+    return NULL;
+  while(w->failed_block == -1) {
+    extent_node *n = w->path[w->level];
+    if(w->next[w->level] == n->num_entries) {
+      if(n == &w->node->root.header)
+        return NULL;
+      w->level++;
+      continue;
+    }
+    
+    int i = w->next[w->level]++;
+    if(w->level == 0) {
+      extent *e = &node_extents(n)[i];
+      if(e->file_block != w->file_block || !data_extent(h, e->start, e->length))
+        break;
+      w->file_block += e->length;
+      return e;
+    }
+    
+    extent_index *index = &node_children(n)[i];
+    if(index->file_block != w->file_block || !data_block(h, index->block))
+      break;
+    extent_node *child = (extent_node *) block_at(h, index->block);
+    if(child->depth != w->level - 1 || child->num_entries > h->node_entries)
+      break;
+    
+    w->level--;
+    w->path[w->level] = child;
+    w->next[w->level] = 0;
+    if(w->tree_blocks) {
+      w->tree_extent = (extent) { index->file_block, index->block, 1 };
+      return &w->tree_extent;
+    }
   }
   
-  // Create a new, empty filesystem to use temporarily to save to a file on the system
-  uint8_t **new_filesystem = calloc(NUM_BLOCKS, sizeof(uint8_t *));
+  if(w->failed_block == -1)
+    w->failed_block = block_index_of(h, w->path[w->level]);
+  return NULL;
+}
+
+// Return true if e is the block of a node visited by walk w, rather
+// than an extent holding file data
+static inline bool tree_extent(extent_walk *w, extent *e) {
+  return e == &w->tree_extent;
+}
+
+static inline uint64_t rotate_left(uint64_t x, int bits) {
+  return x << bits | x >> (64 - bits);
+}
 
-  // Initialize all data in blocks to 0
-  for(int i = 0; i < NUM_BLOCKS; i++) {
-    new_filesystem[i] = calloc(BLOCK_SIZE, sizeof(uint8_t));
-    memset(new_filesystem[i], 0, BLOCK_SIZE);
+// Hash the block of len bytes at data into a 64 bit fingerprint. The words
+// of the block are mixed into four independent lanes, which lets the
+// processor work on several of them at once.
+static uint64_t fingerprint_block(const void *data, int len) {
+  const uint64_t prime1 = UINT64_C(0x9e3779b185ebca87);
+  const uint64_t prime2 = UINT64_C(0xc2b2ae3d27d4eb4f);
+  const uint64_t *words = data;
+  uint64_t lanes[4] = { prime1, prime2, -prime1, -prime2 };
+  for(int i = 0; i < len / 8; i += 4) {
+    for(int j = 0; j < 4; j++)
+      lanes[j] = rotate_left(lanes[j] + words[i + j] * prime2, 31) * prime1;
   }
   
-  // Set all inodes and blocks to free (1)
-  memset(new_filesystem[2], 1, MAX_FILES);
-  memset(new_filesystem[3], 1, NUM_BLOCKS);
+  uint64_t hash = rotate_left(lanes[0], 1) ^ rotate_left(lanes[1], 7) ^
+    rotate_left(lanes[2], 12) ^ rotate_left(lanes[3], 18);
+  hash ^= hash >> 33;
+  hash *= prime2;
+  hash ^= hash >> 29;
+  return hash;
+}
+
+// Add block to the dedup index under fingerprint fp
+static void link_dedup_block(mfs_t *h, int block, uint64_t fp) {
+  int *head = &h->dedup_heads[fp & h->dedup_mask];
+  h->dedup_fingerprints[block] = fp;
+  h->dedup_next[block] = *head;
+  *head = block;
+  bitmap_set(h->dedup_map, block);
+}
+
+// Remove block from the dedup index if it is in it. This must be done
+// before the block is freed, since it may be reused for other data.
+static void unlink_dedup_block(mfs_t *h, int block) {
+  if(!bitmap_test(h->dedup_map, block))
+    return;
   
-  // Set blocks 0-130 to used (0)
-  memset(new_filesystem[3], 0, MAX_FILES+5);
+  int *link = &h->dedup_heads[h->dedup_fingerprints[block] & h->dedup_mask];
+  while(*link != block)
+    link = &h->dedup_next[*link];
+  *link = h->dedup_next[block];
+  bitmap_clear(h->dedup_map, block);
+}
+
+// Build the dedup index from every data block that a file references. The
+// blocks holding extent trees are left out, since they change as files grow.
+// The caller must hold dedup_lock.
+static void build_dedup_index(mfs_t *h) {
+  int buckets = 1;
+  while(buckets < 2 * h->num_blocks)
+    buckets *= 2;
+  h->dedup_mask = buckets - 1;
   
+  h->dedup_heads = malloc(buckets * sizeof(int));
+  memset(h->dedup_heads, -1, buckets * sizeof(int));
+  h->dedup_next = malloc(h->num_blocks * sizeof(int));
+  h->dedup_fingerprints = malloc(h->num_blocks * sizeof(uint64_t));
+  h->dedup_map = calloc(BITMAP_WORDS(h->num_blocks), sizeof(uint64_t));
   
-  // Initialize our offsets and pointers just we did above when reading from the file.
-  block_ptr block_index = 0;
-  int copy_size = BLOCK_SIZE * NUM_BLOCKS;
-  int offset = 0;
+  for(int i = 0; i < h->max_files; i++) {
+    if(inode_free(h, i))
+      continue;
+    
+    extent_walk w;
+    start_walk(&w, h, h->inodes[i], false);
+    for(extent *e; (e = next_extent(&w)) != NULL; ) {
+      for(int j = e->start; j < e->start + e->length; j++) {
+        if(!bitmap_test(h->dedup_map, j))
+          link_dedup_block(h, j, fingerprint_block(block_at(h, j), h->block_size));
+      }
+    }
+  }
+  h->dedup_built = true;
+}
 
-  printf("Writing %d bytes to %s\n", copy_size, name);
+// Free the memory used by the dedup index
+static void free_dedup_index(mfs_t *h) {
+  free(h->dedup_heads);
+  free(h->dedup_next);
+  free(h->dedup_fingerprints);
+  free(h->dedup_map);
+}
 
-  // Using copy_size as a count to determine when we've copied enough bytes to the output file.
-  // Each time through the loop, we will copy BLOCK_SIZE number of bytes from  our stored data
-  // to the file fp, then we will increment the offset into the file we are writing to.
-  while(copy_size > 0) {
-    // Write BLOCK_SIZE number of bytes from empty array into our output file.
-    fwrite(new_filesystem[block_index], BLOCK_SIZE, 1, ofp);
+// Return a block in the dedup index holding the same block_size bytes as
+// data, which has fingerprint fp, or -1 if there is none. The data is
+// compared as well, so blocks that only share a fingerprint never match.
+static int find_dedup_block(mfs_t *h, const uint8_t *data, uint64_t fp) {
+  int block = h->dedup_heads[fp & h->dedup_mask];
+  while(block != -1) {
+    if(h->dedup_fingerprints[block] == fp && memcmp(block_at(h, block), data, h->block_size) == 0)
+      return block;
+    block = h->dedup_next[block];
+  }
+  return -1;
+}
 
-    // Reduce the amount of bytes remaining to copy, increase the offset into the file
-    // and increment the block_index to move us to the next data block.
-    copy_size -= BLOCK_SIZE;
-    offset    += BLOCK_SIZE;
-    block_index++;
+// Add a reference to every block of extent e, marking the blocks that
+// weren't referenced by anything yet as used. The caller must hold the
+// lock of the group of the extent.
+static void ref_extent(mfs_t *h, extent *e) {
+  for(int i = e->start; i < e->start + e->length; i++) {
+    if(h->block_refs[i]++ == 0)
+      set_block_free(h, i, false);
+  }
+}
 
-    // Since we've copied from the point pointed to by our current file pointer, increment
-    // offset number of bytes so we will be ready to copy to the next area of our output file.
-    fseek(ofp, offset, SEEK_SET);
+// Drop a reference to every block of extent e, freeing the blocks
+// that are no longer referenced by anything. The caller must hold the
+// lock of the group of the extent, and dedup_lock in dedup mode.
+static void unref_extent(mfs_t *h, extent *e) {
+  for(int i = e->start; i < e->start + e->length; i++) {
+    if(--h->block_refs[i] == 0) {
+      if(h->dedup_built)
+        unlink_dedup_block(h, i);
+      set_block_free(h, i, true);
+    }
   }
+}
 
-  // Close the output file, we're done. 
-  fclose(ofp);
+// Add a reference to every block of the file node, the blocks holding its
+// extent tree included. The caller must hold the lock of every group.
+static void ref_file(mfs_t *h, inode *node) {
+  extent_walk w;
+  start_walk(&w, h, node, true);
+  for(extent *e; (e = next_extent(&w)) != NULL; )
+    ref_extent(h, e);
+}
 
-  // Free up the memory allocated for setting up the new filesystem image
-  for(int i = 0; i < NUM_BLOCKS; i++) {
-    free(new_filesystem[i]);
-  }
-  free(new_filesystem);
+// Take a reference to extent e, locking its group
+static void ref_extent_locked(mfs_t *h, extent *e) {
+  alloc_group *g = block_group(h, e->start);
+  pthread_mutex_lock(&g->lock);
+  ref_extent(h, e);
+  pthread_mutex_unlock(&g->lock);
+}
+
+// Drop a reference to extent e, locking its group. In dedup mode the
+// caller must hold dedup_lock.
+static void unref_extent_locked(mfs_t *h, extent *e) {
+  alloc_group *g = block_group(h, e->start);
+  pthread_mutex_lock(&g->lock);
+  unref_extent(h, e);
+  pthread_mutex_unlock(&g->lock);
+}
+
+// Drop the reference of the file node to each of its blocks, the blocks
+// holding its extent tree included. In dedup mode the caller must hold
+// dedup_lock.
+static void unref_file(mfs_t *h, inode *node) {
+  extent_walk w;
+  start_walk(&w, h, node, true);
+  for(extent *e; (e = next_extent(&w)) != NULL; )
+    unref_extent_locked(h, e);
+}
+
+// Return the entry of data block block in the checksum region
+static inline uint32_t *checksum_of(mfs_t *h, int block) {
+  return &h->checksums[block - h->data_start];
+}
+
+// Mark the blocks of the checksum region holding the checksums of extent e
+// as modified. The caller must hold the lock of the group of the extent,
+// which has the checksum blocks of its blocks to itself.
+static void mark_checksums_dirty(mfs_t *h, extent *e) {
+  int first = block_index_of(h, checksum_of(h, e->start));
+  int last  = block_index_of(h, checksum_of(h, e->start + e->length - 1));
+  mark_dirty_blocks(h, first, last - first + 1);
+}
+
+// Set the checksum of every block of extent e from the data in it
+static void update_checksums(mfs_t *h, extent *e) {
+  for(int i = e->start; i < e->start + e->length; i++)
+    *checksum_of(h, i) = crc32c(0, block_at(h, i), h->block_size);
+}
+
+// Return the CRC32C of the checksums of the blocks of the file node, in the
+// order they are walked, or of its data if it is inline
+static uint32_t file_checksum(mfs_t *h, inode *node) {
+  if(node->flags & INODE_INLINE)
+    return crc32c(0, inline_data(node), node->bytes);
   
-  return 0;
+  uint32_t crc = 0;
+  extent_walk w;
+  start_walk(&w, h, node, true);
+  for(extent *e; (e = next_extent(&w)) != NULL; ) {
+    for(int j = e->start; j < e->start + e->length; j++)
+      crc = crc32c(crc, checksum_of(h, j), sizeof(uint32_t));
+  }
+  return crc;
 }
 
-// Save the currently opened filesystem in the current
-// directory with the value of disk_image_name as its name
-int fs_savefs() {
-  if(!opened) {
-    printf("savefs error: No file system is currently open\n");
-    return -1;
+// Check every block of the file node against its checksum, the blocks
+// holding its extent tree included. Returns the first block that doesn't
+// match or holds a corrupt node, or -1 if they all match. An inline file is
+// checked against the checksum in its inode, and returns the block holding
+// the inode if it doesn't match.
+static int verify_file(mfs_t *h, inode *node) {
+  if(node->flags & INODE_INLINE)
+    return file_checksum(h, node) == node->checksum ? -1 : block_index_of(h, node);
+  
+  extent_walk w;
+  start_walk(&w, h, node, true);
+  for(extent *e; (e = next_extent(&w)) != NULL; ) {
+    for(int j = e->start; j < e->start + e->length; j++) {
+      if(crc32c(0, block_at(h, j), h->block_size) != *checksum_of(h, j))
+        return j;
+    }
   }
+  return w.failed_block;
+}
 
-  // Now, open the output file that we are going to write the data to.
-  FILE *ofp;
-  ofp = fopen(disk_image_name, "w");
+// Set the checksum of each block holding the extent tree of the file node,
+// once the tree is complete
+static void update_tree_checksums(mfs_t *h, inode *node) {
+  extent_walk w;
+  start_walk(&w, h, node, true);
+  for(extent *e; (e = next_extent(&w)) != NULL; ) {
+    if(tree_extent(&w, e))
+      update_checksums(h, e);
+  }
+}
 
-  if(ofp == NULL) {
-    printf("savefs error: Could not open file \"%s\": ", disk_image_name);
-    fflush(stdout);
-    perror("");
-    return -1;
+// Search the free runs of blocks of group g in [from, limit), counted from
+// the start of the group, for a run of at least want blocks. Returns true
+// when one is found, otherwise updates best_start and best_length whenever
+// a run longer than best_length is found.
+static bool find_free_run(alloc_group *g, int from, int limit, int want, int *best_start, int *best_length) {
+  while(from < limit) {
+    int run_start = bitmap_find_next(g->block_map, g->num_blocks, from);
+    if(run_start == -1 || run_start >= limit)
+      return false;
+    
+    int run_end = bitmap_find_next_zero(g->block_map, g->num_blocks, run_start);
+    if(run_end == -1)
+      run_end = g->num_blocks;
+    
+    int run_length = run_end - run_start;
+    if(run_length >= want) {
+      *best_start  = run_start;
+      *best_length = want;
+      return true;
+    }
+    if(run_length > *best_length) {
+      *best_start  = run_start;
+      *best_length = run_length;
+    }
+    from = run_end;
   }
+  return false;
+}
 
-  // Initialize our offsets and pointers just we did above when reading from the file.
-  block_ptr block_index = 0;
-  int copy_size = BLOCK_SIZE * NUM_BLOCKS;
-  int offset = 0;
+// When built with -DFS_DEBUG, check that the free counts of group g still
+// agree with its bitmaps after every operation that changes them. The
+// caller must hold the lock of the group.
+#ifdef FS_DEBUG
+static void check_free_counts(alloc_group *g) {
+  assert(g->free_inodes == bitmap_count(g->inode_map, g->num_inodes));
+  assert(g->free_blocks == bitmap_count(g->block_map, g->num_blocks));
+}
+#else
+#define check_free_counts(g)
+#endif
 
-  printf("Writing %d bytes to %s\n", copy_size, disk_image_name);
+// Allocate up to want contiguous free blocks as extent e and mark them as used.
+// The groups are tried in turn starting from group home, which is the group
+// of the inode of the file in the common case, so that a file ends up next
+// to its inode and files in different groups never wait on each other. In
+// each group the first free run after its block hint that can hold all of
+// the blocks is used, wrapping around to the start of the group. If no group
+// has a run long enough, the longest run of the first group with any free
+// blocks is used and the caller has to allocate the rest of the blocks in
+// another extent. Returns the number of blocks allocated.
+static int alloc_extent(mfs_t *h, int home, int want, extent *e) {
+  // No run can be longer than the data blocks of a group
+  if(want > h->group_blocks - h->group_meta_blocks)
+    want = h->group_blocks - h->group_meta_blocks;
+  
+  for(int pass = 0; pass < 2; pass++) {
+    for(int i = 0; i < h->num_groups; i++) {
+      alloc_group *g = &h->groups[(home + i) % h->num_groups];
+      pthread_mutex_lock(&g->lock);
+      int start  = -1;
+      int length = 0;
+      if(g->free_blocks >= (pass == 0 ? want : 1)) {
+        int hint = g->block_hint;
+        if(!find_free_run(g, hint, g->num_blocks, want, &start, &length))
+          find_free_run(g, 0, hint, want, &start, &length);
+      }
+      
+      if(length == want || (pass == 1 && length > 0)) {
+        e->start  = g->first_block + start;
+        e->length = length;
+        ref_extent(h, e);
+        mark_checksums_dirty(h, e);
+        check_free_counts(g);
+        pthread_mutex_unlock(&g->lock);
+        return length;
+      }
+      pthread_mutex_unlock(&g->lock);
+    }
+  }
+  return 0;
+}
 
-  // Using copy_size as a count to determine when we've copied enough bytes to the output file.
-  // Each time through the loop, we will copy BLOCK_SIZE number of bytes from  our stored data
-  // to the file fp, then we will increment the offset into the file we are writing to.
-  while(copy_size > 0) {
-    // Write BLOCK_SIZE number of bytes from our data array into our output file.
-    fwrite(filesystem[block_index], BLOCK_SIZE, 1, ofp);
+// Return the allocation group of the inode node, which new blocks of
+// its file are taken from first
+static inline int home_group(mfs_t *h, inode *node) {
+  return block_group(h, block_index_of(h, node)) - h->groups;
+}
 
-    // Reduce the amount of bytes remaining to copy, increase the offset into the file
-    // and increment the block_index to move us to the next data block.
-    copy_size -= BLOCK_SIZE;
-    offset    += BLOCK_SIZE;
-    block_index++;
+// Set up block as an empty node of an extent tree at depth depth
+static extent_node *init_tree_node(mfs_t *h, block_ptr block, int depth) {
+  extent_node *n = (extent_node *) block_at(h, block);
+  memset(n, 0, h->block_size);
+  n->depth = depth;
+  mark_dirty_blocks(h, block, 1);
+  return n;
+}
 
-    // Since we've copied from the point pointed to by our current file pointer, increment
-    // offset number of bytes so we will be ready to copy to the next area of our output file.
-    fseek(ofp, offset, SEEK_SET);
+// Fill path with the last node at each depth of the extent tree of node,
+// from the root down to the last leaf
+static void last_path(mfs_t *h, inode *node, extent_node **path) {
+  int depth = node->root.header.depth;
+  path[depth] = &node->root.header;
+  for(int d = depth; d > 0; d--) {
+    extent_index *last = &node_children(path[d])[path[d]->num_entries - 1];
+    path[d - 1] = (extent_node *) block_at(h, last->block);
   }
+}
 
-  // Close the output file, we're done. 
-  fclose(ofp);
-
-  return 0;
+// Return the last extent of the file node, or NULL if it has none
+static extent *last_extent(mfs_t *h, inode *node) {
+  extent_node *path[MAX_EXTENT_DEPTH + 1];
+  if(node->num_extents == 0)
+    return NULL;
+  last_path(h, node, path);
+  return &node_extents(path[0])[path[0]->num_entries - 1];
 }
 
-// Set attribute (a) in file with filename (filename) to either
-// enabled or disabled
-int fs_setattrib(char *filename, attrib a, bool enabled) {
-  if(!opened) {
-    printf("attrib error: No file system is currently open\n");
+// Add an extent of length blocks starting at block start to the end of the
+// file node. New nodes are added to the extent tree as the last ones fill up,
+// and the tree grows a level once its root is full. In dedup mode the caller
+// must hold dedup_lock. Returns -1 with errno set to ENOSPC if there are no
+// free blocks for the new nodes, or EFBIG if the tree can't grow any deeper.
+static int add_extent(mfs_t *h, inode *node, block_ptr start, uint32_t length) {
+  extent_node *path[MAX_EXTENT_DEPTH + 2];
+  int depth = node->root.header.depth;
+  last_path(h, node, path);
+  
+  // Find the lowest node with room for another entry. Each node below it
+  // takes a new block, as does the old root if the tree has to grow.
+  int level = 0;
+  while(level <= depth && path[level]->num_entries == node_capacity(h, node, path[level]))
+    level++;
+  if(level > depth && depth == MAX_EXTENT_DEPTH) {
+    errno = EFBIG;
     return -1;
   }
-  if(strnlen(filename, MAX_FILENAME+1) > MAX_FILENAME) {
-    printf("attrib error: File name too long\n");
-    return -1;
+  
+  // Take the blocks of the new nodes before changing anything, so that
+  // the tree is left as it was if they don't all fit
+  block_ptr blocks[MAX_EXTENT_DEPTH + 1];
+  for(int i = 0; i < level; i++) {
+    extent e;
+    if(alloc_extent(h, home_group(h, node), 1, &e) == 0) {
+      while(i-- > 0)
+        unref_extent_locked(h, &(extent) { 0, blocks[i], 1 });
+      errno = ENOSPC;
+      return -1;
+    }
+    blocks[i] = e.start;
   }
   
-  int idx = find_dir_entry(filename, true);
-  if(idx == -1) {
-    printf("attrib error: Could not find file with name \"%s\"\n", filename);
-    return -1;
+  // Move the entries of a full root into a new node below it, which then
+  // has room for more
+  extent_node *root = &node->root.header;
+  if(level > depth) {
+    extent_node *moved = init_tree_node(h, blocks[--level], depth);
+    memcpy(moved, root, sizeof(extent_root));
+    root->depth = ++depth;
+    root->num_entries = 1;
+    node_children(root)[0] = (extent_index) { 0, blocks[level], 0 };
+    path[depth] = root;
+    path[level] = moved;
   }
   
-  // Set specific bit in attrib associated with either hidden or
-  // read-only to enabled/disabled
-  int inode_idx = dir_entries[idx]->inode;
-  if(enabled)
-    inodes[inode_idx]->attrib |=  a & 0b11;
-  else
-    inodes[inode_idx]->attrib &= ~a & 0b11;
+  // Add a new node below each full one, down to a new leaf
+  uint64_t file_block = node->used_blocks;
+  for(int d = level; d > 0; d--) {
+    path[d - 1] = init_tree_node(h, blocks[d - 1], d - 1);
+    node_children(path[d])[path[d]->num_entries++] = (extent_index) { file_block, blocks[d - 1], 0 };
+    mark_dirty(h, path[d]);
+  }
   
+  node_extents(path[0])[path[0]->num_entries++] = (extent) { file_block, start, length };
+  mark_dirty(h, path[0]);
+  node->num_extents++;
   return 0;
 }
 
-// Open file on system with name filename as current filesystem
-int fs_open(char *filename) {
-  if(opened) {
-    printf("open error: Another file system is already open\n");
-    return -1;
+// Count the free inodes and blocks of each group from its bitmaps
+static void count_free(mfs_t *h) {
+  h->free_inode_count = 0;
+  h->free_block_count = 0;
+  for(int i = 0; i < h->num_groups; i++) {
+    alloc_group *g = &h->groups[i];
+    g->free_inodes = bitmap_count(g->inode_map, g->num_inodes);
+    g->free_blocks = bitmap_count(g->block_map, g->num_blocks);
+    h->free_inode_count += g->free_inodes;
+    h->free_block_count += g->free_blocks;
   }
-  
-  
-  if(strnlen(filename, MAX_FILENAME+1) > MAX_FILENAME) {
-    printf("open error: File name too long\n");
-    return -1;
+}
+
+// Return true if the count blocks starting at block are the same in the
+// image file as they are in memory, because they have neither been
+// modified nor are waiting in the journal to be written back
+static bool blocks_on_disk(mfs_t *h, int block, int count) {
+  return memchr(&h->dirty_blocks[block], true, count) == NULL &&
+    memchr(&h->journaled_blocks[block], true, count) == NULL;
+}
+
+// Copy len bytes from blocks starting at block into fd starting at offset.
+// When the image is mapped and the blocks in the image file are up to date,
+// the kernel copies the data from the image file into fd with copy_file_range,
+// falling back to writing from the blocks when the files don't support it.
+static int write_from_blocks(mfs_t *h, int fd, off_t offset, int block, size_t len) {
+  size_t copied = 0;
+  if(h->image_fd != -1 && blocks_on_disk(h, block, (len + h->block_size - 1) / h->block_size)) {
+    loff_t src = (loff_t) block * h->block_size;
+    loff_t dst = offset;
+    while(copied < len) {
+      ssize_t n = copy_file_range(h->image_fd, &src, fd, &dst, len - copied, 0);
+      if(n <= 0)
+        break;
+      copied += n;
+    }
   }
-  
-  int    status;                   // Hold the status of all return values.
-  struct stat buf;                 // stat struct to hold the returns from the stat call
+  return write_all(fd, block_at(h, block) + copied, len - copied, offset + copied);
+}
 
-  // Call stat with out input filename to verify that the file exists.  It will also 
-  // allow us to get the file size. We also get interesting file system info about the
-  // file such as inode number, block size, and number of blocks.  For now, we don't 
-  // care about anything but the filesize.
-  status =  stat(filename, &buf); 
+// Take a free inode and mark it as used, trying each group in turn starting
+// from the one after the group the last file was given. This spreads files
+// being put at the same time across the groups, so they don't wait on each
+// other to take their blocks. In each group the search starts from its inode
+// hint and wraps around to the start. Returns the index of the inode, or -1
+// if there are no free inodes.
+static int take_inode(mfs_t *h) {
+  int first = __atomic_fetch_add(&h->next_group, 1, __ATOMIC_RELAXED) % h->num_groups;
+  for(int i = 0; i < h->num_groups; i++) {
+    alloc_group *g = &h->groups[(first + i) % h->num_groups];
+    pthread_mutex_lock(&g->lock);
+    int bit = bitmap_find_next(g->inode_map, g->num_inodes, g->inode_hint);
+    if(bit == -1)
+      bit = bitmap_find_next(g->inode_map, g->num_inodes, 0);
+    if(bit != -1) {
+      set_inode_free(h, g->first_inode + bit, false);
+      check_free_counts(g);
+    }
+    pthread_mutex_unlock(&g->lock);
+    if(bit != -1)
+      return g->first_inode + bit;
+  }
+  return -1;
+}
+
+// Hash up to MAX_FILENAME characters of filename (FNV-1a)
+static uint32_t hash_filename(const char *filename) {
+  uint32_t hash = 2166136261u;
+  for(int i = 0; i < MAX_FILENAME && filename[i]; i++) {
+    hash ^= (uint8_t) filename[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Return true if the filename contains only valid characters
+bool valid_filename(char *filename) {
+  int len = strnlen(filename, MAX_FILENAME);
+  for(int i = 0; i < len; i++) {
+    char c = tolower(filename[i]);
+    if(!(c >= 'a' && c <= 'z') && !(c >= '0' && c <= '9') && c != '.') {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Return the first of the entries of the directory node n, which are dir
+// entries in a leaf and dir_index entries in any other node. Both start
+// with the hash they are ordered by.
+static inline uint8_t *dir_items(dir_node *n) {
+  return (uint8_t *) (n + 1);
+}
+
+// Return the size of each entry of a directory node at depth depth
+static inline size_t dir_item_size(int depth) {
+  return depth == 0 ? sizeof(dir_entry) : sizeof(dir_index);
+}
+
+// Return the hash of entry i of the directory node n
+static inline uint32_t dir_item_hash(dir_node *n, int i) {
+  return *(uint32_t *) (dir_items(n) + i * dir_item_size(n->depth));
+}
+
+// Return the number of entries the directory node n has room for
+static inline int dir_capacity(mfs_t *h, dir_node *n) {
+  return n->depth == 0 ? h->dir_leaf_entries : h->dir_node_entries;
+}
+
+// Return the node of a directory in block
+static inline dir_node *dir_node_at(mfs_t *h, block_ptr block) {
+  return (dir_node *) block_at(h, block);
+}
+
+// Return the number of entries of the directory node n, skipping the first
+// skip, that come before hash, or that are at most hash if after is true.
+// The entries are in order of hash, so this takes a binary search.
+static int dir_search(dir_node *n, int skip, uint32_t hash, bool after) {
+  int low = skip;
+  int high = n->num_entries;
+  while(low < high) {
+    int mid = (low + high) / 2;
+    uint32_t mid_hash = dir_item_hash(n, mid);
+    if(mid_hash < hash || (after && mid_hash == hash))
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+// Fill path with the nodes of the directory dir from its root down to the
+// leaf where entries with hash are, and slot with the entry of each node
+// the path goes through. If last is true, the leaf is the last one that can
+// hold hash, where a new entry with it goes. Otherwise it is the first, which
+// a search for entries with hash starts from. Returns the depth of the root.
+static int dir_path(mfs_t *h, inode *dir, uint32_t hash, bool last, dir_node **path, int *slot) {
+  dir_node *n = dir_node_at(h, *dir_root(dir));
+  int depth = n->depth;
+  path[depth] = n;
+  for(int d = depth; d > 0; d--) {
+    // The first entry of a node covers every hash before the second one
+    int i = dir_search(path[d], 1, hash, last) - 1;
+    slot[d] = i;
+    path[d - 1] = dir_node_at(h, ((dir_index *) dir_items(path[d]))[i].block);
+  }
+  return depth;
+}
+
+// Return the leaf after the leaf n of a directory, or NULL if it is the last
+static inline dir_node *next_leaf(mfs_t *h, dir_node *n) {
+  return n->next != 0 ? dir_node_at(h, n->next) : NULL;
+}
+
+// Return the first leaf of the directory dir
+static dir_node *first_leaf(mfs_t *h, inode *dir) {
+  dir_node *n = dir_node_at(h, *dir_root(dir));
+  while(n->depth > 0)
+    n = dir_node_at(h, ((dir_index *) dir_items(n))[0].block);
+  return n;
+}
+
+// Find the dir entry named name in the directory dir, whatever its state.
+// Returns NULL if there is none.
+static dir_entry *find_entry(mfs_t *h, inode *dir, const char *name) {
+  uint32_t hash = hash_filename(name);
+  dir_node *path[MAX_DIR_DEPTH + 1];
+  int slot[MAX_DIR_DEPTH + 1];
+  dir_path(h, dir, hash, false, path, slot);
+  
+  // Entries with the same hash can run on into the following leaves
+  dir_node *leaf = path[0];
+  for(int i = dir_search(leaf, 0, hash, false); leaf != NULL; leaf = next_leaf(h, leaf), i = 0) {
+    for(; i < leaf->num_entries; i++) {
+      dir_entry *entry = &((dir_entry *) dir_items(leaf))[i];
+      if(entry->hash != hash)
+        return NULL;
+      if(strncmp(entry->filename, name, MAX_FILENAME) == 0)
+        return entry;
+    }
+  }
+  return NULL;
+}
+
+// Set up block as an empty node of a directory at depth depth
+static dir_node *init_dir_node(mfs_t *h, block_ptr block, int depth) {
+  dir_node *n = dir_node_at(h, block);
+  memset(n, 0, h->block_size);
+  n->depth = depth;
+  mark_dirty_blocks(h, block, 1);
+  return n;
+}
+
+// Insert item, an entry of the directory node n, at position pos of n,
+// which must have room for it
+static void dir_node_insert(mfs_t *h, dir_node *n, int pos, const void *item) {
+  size_t size = dir_item_size(n->depth);
+  uint8_t *items = dir_items(n);
+  memmove(items + (pos + 1) * size, items + pos * size, (n->num_entries - pos) * size);
+  memcpy(items + pos * size, item, size);
+  n->num_entries++;
+  mark_dirty(h, n);
+}
+
+// Add a dir entry named name for inode inode_idx in state state to the
+// directory dir, which must not have an entry with the same name yet. A full
+// node is split in two on the way, moving the upper half of its entries into
+// a new node after it, and the tree grows a level once its root is split. In
+// dedup mode the caller must hold dedup_lock. Returns -1 with errno set to
+// ENOSPC if there are no free blocks for the new nodes, or EFBIG if the tree
+// can't grow any deeper.
+static int insert_entry(mfs_t *h, inode *dir, const char *name, int inode_idx, int state) {
+  uint32_t hash = hash_filename(name);
+  dir_node *path[MAX_DIR_DEPTH + 2];
+  int slot[MAX_DIR_DEPTH + 2];
+  int depth = dir_path(h, dir, hash, true, path, slot);
+  
+  // Find the lowest node with room for another entry. Each node below it
+  // is split, taking a new block, as is the root if the tree has to grow.
+  int level = 0;
+  while(level <= depth && path[level]->num_entries == dir_capacity(h, path[level]))
+    level++;
+  if(level > depth && depth == MAX_DIR_DEPTH) {
+    errno = EFBIG;
+    return -1;
+  }
+  
+  // Take the blocks of the new nodes before changing anything, so that
+  // the tree is left as it was if they don't all fit
+  int num_new = level + (level > depth);
+  block_ptr blocks[MAX_DIR_DEPTH + 2];
+  for(int i = 0; i < num_new; i++) {
+    extent e;
+    if(alloc_extent(h, home_group(h, dir), 1, &e) == 0) {
+      while(i-- > 0)
+        unref_extent_locked(h, &(extent) { 0, blocks[i], 1 });
+      errno = ENOSPC;
+      return -1;
+    }
+    blocks[i] = e.start;
+  }
+  dir->used_blocks += num_new;
+  dir->bytes = (uint64_t) dir->used_blocks * h->block_size;
+  mark_dirty(h, dir);
+  
+  // A new root goes above the old one, which becomes its only child
+  if(level > depth) {
+    dir_node *root = init_dir_node(h, blocks[level], depth + 1);
+    ((dir_index *) dir_items(root))[0] = (dir_index) { 0, *dir_root(dir) };
+    root->num_entries = 1;
+    *dir_root(dir) = blocks[level];
+    path[++depth] = root;
+    slot[depth] = 0;
+  }
+  
+  // Add the entry to its leaf, splitting each full node on the way up and
+  // adding the new node after it to the node above
+  // The rest of the filename is left as zeros, and a name of MAX_FILENAME
+  // characters fills it without a terminator
+  dir_entry entry = { hash, inode_idx, state };
+  memcpy(entry.filename, name, strnlen(name, MAX_FILENAME));
+  dir_index index;
+  const void *item = &entry;
+  int pos = dir_search(path[0], 0, hash, true);
+  for(int d = 0; d < level; d++) {
+    dir_node *n = path[d];
+    dir_node *right = init_dir_node(h, blocks[d], d);
+    size_t size = dir_item_size(d);
+    int half = n->num_entries / 2;
+    memcpy(dir_items(right), dir_items(n) + half * size, (n->num_entries - half) * size);
+    right->num_entries = n->num_entries - half;
+    n->num_entries = half;
+    if(d == 0) {
+      right->next = n->next;
+      n->next = blocks[d];
+    }
+    mark_dirty(h, n);
+    
+    if(pos > half)
+      dir_node_insert(h, right, pos - half, item);
+    else
+      dir_node_insert(h, n, pos, item);
+    
+    index = (dir_index) { dir_item_hash(right, 0), blocks[d] };
+    item = &index;
+    pos = slot[d + 1] + 1;
+  }
+  dir_node_insert(h, path[level], pos, item);
+  return 0;
+}
+
+// Fill path and slot as dir_path does for the path from the root of the
+// directory dir down to its leaf leaf, which holds or held entries with
+// hash. Returns the depth of the root.
+static int dir_path_to(mfs_t *h, inode *dir, dir_node *leaf, uint32_t hash, dir_node **path, int *slot) {
+  int depth = dir_path(h, dir, hash, false, path, slot);
+  
+  // Entries with the same hash can run on into the following leaves, so
+  // step along the leaves in order until reaching it
+  while(path[0] != leaf) {
+    int d = 1;
+    while(slot[d] == path[d]->num_entries - 1)
+      d++;
+    for(slot[d]++; d > 0; d--) {
+      path[d - 1] = dir_node_at(h, ((dir_index *) dir_items(path[d]))[slot[d]].block);
+      slot[d - 1] = 0;
+    }
+  }
+  return depth;
+}
+
+// Remove the dir entry entry of the directory dir from the leaf holding it.
+// A leaf left empty is freed, along with every node above it left without
+// entries, and then the root is replaced by its only child for as long as
+// it has just one. In dedup mode the caller must hold dedup_lock.
+static void remove_entry(mfs_t *h, inode *dir, dir_entry *entry) {
+  dir_node *leaf = dir_node_at(h, block_index_of(h, entry));
+  dir_entry *entries = (dir_entry *) dir_items(leaf);
+  int pos = entry - entries;
+  uint32_t hash = entry->hash;
+  if(entry->state == ENTRY_DELETED) {
+    dir_header_of(dir)->deleted_entries--;
+    mark_dirty(h, dir);
+  }
+  memmove(entry, entry + 1, (leaf->num_entries - pos - 1) * sizeof(dir_entry));
+  leaf->num_entries--;
+  mark_dirty(h, leaf);
+  if(leaf->num_entries > 0 || dir_node_at(h, *dir_root(dir)) == leaf)
+    return;
+  
+  dir_node *path[MAX_DIR_DEPTH + 1];
+  int slot[MAX_DIR_DEPTH + 1];
+  int depth = dir_path_to(h, dir, leaf, hash, path, slot);
+  
+  // The leaf before it is the last leaf under the entry before the one the
+  // path takes in the lowest node where that isn't the first
+  int d = 1;
+  while(d <= depth && slot[d] == 0)
+    d++;
+  if(d <= depth) {
+    dir_node *prev = dir_node_at(h, ((dir_index *) dir_items(path[d]))[slot[d] - 1].block);
+    while(prev->depth > 0)
+      prev = dir_node_at(h, ((dir_index *) dir_items(prev))[prev->num_entries - 1].block);
+    prev->next = leaf->next;
+    mark_dirty(h, prev);
+  }
+  
+  // Free the leaf and each node above it that has no entries left
+  int freed = 0;
+  for(d = 0; d < depth && path[d]->num_entries == 0; d++) {
+    dir_node *parent = path[d + 1];
+    dir_index *items = (dir_index *) dir_items(parent);
+    int i = slot[d + 1];
+    unref_extent_locked(h, &(extent) { 0, items[i].block, 1 });
+    memmove(&items[i], &items[i + 1], (parent->num_entries - i - 1) * sizeof(dir_index));
+    parent->num_entries--;
+    mark_dirty(h, parent);
+    freed++;
+  }
+  
+  // A tree left without any entries goes back to a single empty leaf
+  dir_node *root = path[depth];
+  if(root->num_entries == 0)
+    init_dir_node(h, *dir_root(dir), 0);
+  while(root->depth > 0 && root->num_entries == 1) {
+    block_ptr child = ((dir_index *) dir_items(root))[0].block;
+    unref_extent_locked(h, &(extent) { 0, *dir_root(dir), 1 });
+    *dir_root(dir) = child;
+    root = dir_node_at(h, child);
+    freed++;
+  }
+  dir->used_blocks -= freed;
+  dir->bytes = (uint64_t) dir->used_blocks * h->block_size;
+  mark_dirty(h, dir);
+}
+
+// Set the state of the dir entry entry of the directory dir, keeping count
+// of the entries of deleted files in dir
+static void set_entry_state(mfs_t *h, inode *dir, dir_entry *entry, int state) {
+  if((entry->state == ENTRY_DELETED) != (state == ENTRY_DELETED)) {
+    dir_header_of(dir)->deleted_entries += state == ENTRY_DELETED ? 1 : -1;
+    mark_dirty(h, dir);
+  }
+  entry->state = state;
+  mark_dirty(h, entry);
+}
+
+// Add a reference to the node of a directory in block and to every node
+// below it, when counting the references to each block
+static void count_dir_refs(mfs_t *h, block_ptr block) {
+  dir_node *n = dir_node_at(h, block);
+  h->block_refs[block]++;
+  for(int i = 0; n->depth > 0 && i < n->num_entries; i++)
+    count_dir_refs(h, ((dir_index *) dir_items(n))[i].block);
+}
+
+// Count the references to each block from the inodes in use
+static void count_block_refs(mfs_t *h) {
+  h->block_refs = calloc(h->num_blocks, sizeof(uint32_t));
+  for(int i = 0; i < h->max_files; i++) {
+    if(inode_free(h, i))
+      continue;
+    
+    if(h->inodes[i]->flags & INODE_DIR)
+      count_dir_refs(h, *dir_root(h->inodes[i]));
+    
+    extent_walk w;
+    start_walk(&w, h, h->inodes[i], true);
+    for(extent *e; (e = next_extent(&w)) != NULL; ) {
+      for(int k = e->start; k < e->start + e->length; k++)
+        h->block_refs[k]++;
+    }
+  }
+}
+
+// Free the node of a directory in block and every node below it. In dedup
+// mode the caller must hold dedup_lock.
+static void free_dir_nodes(mfs_t *h, block_ptr block) {
+  dir_node *n = dir_node_at(h, block);
+  for(int i = 0; n->depth > 0 && i < n->num_entries; i++)
+    free_dir_nodes(h, ((dir_index *) dir_items(n))[i].block);
+  unref_extent_locked(h, &(extent) { 0, block, 1 });
+}
+
+// Return true if the directory dir has no entries other than deleted ones
+static bool dir_empty(mfs_t *h, inode *dir) {
+  for(dir_node *leaf = first_leaf(h, dir); leaf != NULL; leaf = next_leaf(h, leaf)) {
+    dir_entry *entries = (dir_entry *) dir_items(leaf);
+    for(int i = 0; i < leaf->num_entries; i++) {
+      if(entries[i].state != ENTRY_DELETED)
+        return false;
+    }
+  }
+  return true;
+}
+
+// Dir entry of a deleted file that prune_deleted_entries may drop
+typedef struct {
+  char name[MAX_FILENAME+1];
+  time_t time_added;                  // When the file was added, or 0 if its inode was given to another
+} deleted_entry;
+
+// Order deleted entries from the first to drop to the last
+static int compare_deleted_entries(const void *a, const void *b) {
+  time_t ta = ((const deleted_entry *) a)->time_added;
+  time_t tb = ((const deleted_entry *) b)->time_added;
+  return (ta > tb) - (ta < tb);
+}
+
+// Drop the dir entries of deleted files from the directory dir, other than
+// the one of the file with inode keep_idx, until it has no more than half of
+// MAX_DELETED_ENTRIES left. Files whose inode has been given to another file
+// can't be brought back anyway and go first, then the files added longest
+// ago. In dedup mode the caller must hold dedup_lock.
+static void prune_deleted_entries(mfs_t *h, inode *dir, int keep_idx) {
+  int max_deleted = dir_header_of(dir)->deleted_entries;
+  deleted_entry *deleted = malloc(max_deleted * sizeof(deleted_entry));
+  int num_deleted = 0;
+  for(dir_node *leaf = first_leaf(h, dir); leaf != NULL; leaf = next_leaf(h, leaf)) {
+    dir_entry *entries = (dir_entry *) dir_items(leaf);
+    for(int i = 0; i < leaf->num_entries && num_deleted < max_deleted; i++) {
+      int inode_idx = entries[i].inode;
+      if(entries[i].state != ENTRY_DELETED || inode_idx == keep_idx)
+        continue;
+      
+      // A put can take the inode once it is free, which it does with the
+      // lock of its group held
+      deleted_entry *d = &deleted[num_deleted++];
+      snprintf(d->name, sizeof(d->name), "%.*s", MAX_FILENAME, entries[i].filename);
+      d->time_added = 0;
+      if(inode_idx < h->max_files) {
+        alloc_group *g = inode_group(h, inode_idx);
+        pthread_mutex_lock(&g->lock);
+        if(inode_free(h, inode_idx))
+          d->time_added = h->inodes[inode_idx]->time_added;
+        pthread_mutex_unlock(&g->lock);
+      }
+    }
+  }
+  
+  // Dropping an entry can free its leaf, so each one is found again by name
+  qsort(deleted, num_deleted, sizeof(deleted_entry), compare_deleted_entries);
+  for(int i = 0; i < num_deleted && dir_header_of(dir)->deleted_entries > MAX_DELETED_ENTRIES / 2; i++)
+    remove_entry(h, dir, find_entry(h, dir, deleted[i].name));
+  free(deleted);
+}
+
+// Copy the next name of *path into name, skipping the '/' before it, and
+// move *path past it. Returns 1 if a name was copied, 0 if there are none
+// left, or -1 with errno set to ENAMETOOLONG if the name is too long or
+// EINVAL if it holds invalid characters.
+static int next_name(const char **path, char *name) {
+  while(**path == '/')
+    (*path)++;
+  size_t len = strcspn(*path, "/");
+  if(len == 0)
+    return 0;
+  if(len > MAX_FILENAME) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  
+  memcpy(name, *path, len);
+  name[len] = 0;
+  *path += len;
+  if(!valid_filename(name) || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 1;
+}
+
+// Follow path from the root directory to the directory holding the last
+// name of path, which is copied into name. The caller must hold dir_lock.
+// Returns the inode of the directory, or -1 with errno set to ENOENT if a
+// directory along the way doesn't exist, ENOTDIR if it is a file, or as
+// next_name does. A path without any names, like "/", sets errno to EINVAL.
+static int lookup_parent(mfs_t *h, const char *path, char *name) {
+  int dir_idx = ROOT_INODE;
+  int found = next_name(&path, name);
+  if(found == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  
+  char next[MAX_FILENAME+1];
+  while(found == 1 && (found = next_name(&path, next)) == 1) {
+    dir_entry *entry = find_entry(h, h->inodes[dir_idx], name);
+    if(entry == NULL || entry->state != ENTRY_VALID || entry->inode >= h->max_files) {
+      errno = ENOENT;
+      return -1;
+    }
+    if(!(h->inodes[entry->inode]->flags & INODE_DIR)) {
+      errno = ENOTDIR;
+      return -1;
+    }
+    dir_idx = entry->inode;
+    strcpy(name, next);
+  }
+  return found == 0 ? dir_idx : -1;
+}
+
+// Find the valid dir entry at path, and set *parent_idx to the inode of the
+// directory holding it unless parent_idx is NULL. The caller must hold
+// dir_lock. Returns NULL with errno set as lookup_parent does, or to ENOENT
+// if there is no such entry.
+static dir_entry *lookup_entry(mfs_t *h, const char *path, int *parent_idx) {
+  char name[MAX_FILENAME+1];
+  int dir_idx = lookup_parent(h, path, name);
+  if(dir_idx == -1)
+    return NULL;
+  if(parent_idx != NULL)
+    *parent_idx = dir_idx;
+  
+  dir_entry *entry = find_entry(h, h->inodes[dir_idx], name);
+  if(entry == NULL || entry->state != ENTRY_VALID || entry->inode >= h->max_files) {
+    errno = ENOENT;
+    return NULL;
+  }
+  return entry;
+}
+
+// Print why looking up path for the command cmd failed, from errno
+static void print_path_error(const char *cmd, const char *path) {
+  if(errno == ENAMETOOLONG)
+    printf("%s error: File name too long\n", cmd);
+  else if(errno == EINVAL)
+    printf("%s error: Invalid path \"%s\"\n", cmd, path);
+  else if(errno == ENOTDIR)
+    printf("%s error: Not a directory in path \"%s\"\n", cmd, path);
+  else
+    printf("%s error: Unable to find \"%s\"\n", cmd, path);
+}
+
+// Find the directory at path for the command cmd, which is the root
+// directory if path is NULL or has no names, like "/". The caller must hold
+// dir_lock. Returns the inode of the directory, or -1 after printing why
+// there is none.
+static int lookup_dir(mfs_t *h, const char *cmd, const char *path) {
+  if(path == NULL || path[strspn(path, "/")] == 0)
+    return ROOT_INODE;
+  
+  dir_entry *entry = lookup_entry(h, path, NULL);
+  if(entry == NULL) {
+    print_path_error(cmd, path);
+    return -1;
+  }
+  if(!(h->inodes[entry->inode]->flags & INODE_DIR)) {
+    printf("%s error: \"%s\" is not a directory\n", cmd, path);
+    return -1;
+  }
+  return entry->inode;
+}
+
+// Take the dir entry named name in the directory with inode dir_idx for a
+// file that is about to be added, so that no other put uses the name. A
+// deleted entry with the name is taken over, and keeps its inode so that it
+// can be given back. In dedup mode the caller must hold dedup_lock. Returns
+// -1 with errno set to EEXIST if the name is already in use, or as
+// insert_entry does.
+static int reserve_entry(mfs_t *h, int dir_idx, const char *name) {
+  inode *dir = h->inodes[dir_idx];
+  dir_entry *entry = find_entry(h, dir, name);
+  if(entry != NULL && entry->state != ENTRY_DELETED) {
+    errno = EEXIST;
+    return -1;
+  }
+  if(entry != NULL) {
+    set_entry_state(h, dir, entry, ENTRY_PENDING);
+    return 0;
+  }
+  return insert_entry(h, dir, name, NO_INODE, ENTRY_PENDING);
+}
+
+// Give back the dir entry taken by reserve_entry without using it. In
+// dedup mode the caller must hold dedup_lock.
+static void release_entry(mfs_t *h, int dir_idx, const char *name) {
+  inode *dir = h->inodes[dir_idx];
+  dir_entry *entry = find_entry(h, dir, name);
+  if(entry->inode == NO_INODE)
+    remove_entry(h, dir, entry);
+  else
+    set_entry_state(h, dir, entry, ENTRY_DELETED);
+}
+
+// Fill in the dir entry taken by reserve_entry for the new file with inode
+// inode_idx, which makes the file visible
+static void commit_entry(mfs_t *h, int dir_idx, const char *name, int inode_idx) {
+  inode *dir = h->inodes[dir_idx];
+  dir_entry *entry = find_entry(h, dir, name);
+  entry->inode = inode_idx;
+  set_entry_state(h, dir, entry, ENTRY_VALID);
+}
+
+// Print why reserve_entry or insert_entry failed to add the entry named
+// name for the command cmd, from errno
+static void print_entry_error(const char *cmd, const char *name) {
+  if(errno == EEXIST)
+    printf("%s error: Another file with the same name already exists: \"%s\"\n", cmd, name);
+  else if(errno == EFBIG)
+    printf("%s error: Directory is too large\n", cmd);
+  else
+    printf("%s error: Not enough disk space\n", cmd);
+}
+
+// Return the name of the journal of the image with name image. The
+// returned string must be freed by the caller.
+static char *journal_path(char *image) {
+  char *path = malloc(strlen(image) + sizeof(".journal"));
+  sprintf(path, "%s.journal", image);
+  return path;
+}
+
+// Close the journal of the opened image
+static void close_journal(mfs_t *h) {
+  if(h->journal_fd != -1)
+    close(h->journal_fd);
+  h->journal_fd = -1;
+  free(h->journal_name);
+  h->journal_name = NULL;
+}
+
+// Open the journal of the image with name filename, and replay every
+// transaction committed to it into the image file so that the image
+// holds everything that was saved before it was last closed
+static int replay_journal(mfs_t *h, char *filename) {
+  h->journal_name = journal_path(filename);
+  h->journal_size = 0;
+  h->journal_sequence = 1;
+  h->journaled_count = 0;
+  memset(h->journaled_blocks, false, h->num_blocks);
+  
+  h->journal_fd = open(h->journal_name, O_RDWR);
+  if(h->journal_fd == -1) {
+    if(errno == ENOENT)
+      return 0;
+    printf("open error: Could not open file \"%s\": ", h->journal_name);
+    fflush(stdout);
+    perror("");
+    close_journal(h);
+    return -1;
+  }
+  
+  int replayed = -1;
+  int fd = open(filename, O_RDWR);
+  if(fd != -1) {
+    replayed = journal_replay(h->journal_fd, fd, h->num_blocks, h->block_size);
+    close(fd);
+  }
+  
+  // Everything in the journal is in the image now, so it can be emptied
+  if(replayed == -1 || ftruncate(h->journal_fd, 0) == -1) {
+    printf("open error: Could not replay file \"%s\": ", h->journal_name);
+    fflush(stdout);
+    perror("");
+    close_journal(h);
+    return -1;
+  }
+  
+  if(replayed > 0)
+    printf("Replayed %d transactions from %s\n", replayed, h->journal_name);
+  return 0;
+}
+
+// Return the number of blocks of block_size bytes needed to hold bytes bytes
+static inline uint32_t blocks_for(uint64_t bytes, uint32_t block_size) {
+  return (bytes + block_size - 1) / block_size;
+}
+
+// Lay out the regions of an image with the geometry given in sb, filling
+// in where each starts and how the allocation groups are laid out. Returns
+// -1 if the geometry isn't supported or leaves no room for any data blocks.
+static int plan_layout(superblock *sb) {
+  uint32_t block_size = sb->block_size;
+  if(block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0 ||
+      sb->num_blocks > MAX_NUM_BLOCKS || sb->max_files < 1 || sb->max_files > sb->num_blocks)
+    return -1;
+  
+  // The checksum region covers every block after it, so it never has to
+  // be sized by the groups that follow it
+  sb->checksum_start  = 1;
+  sb->checksum_blocks = blocks_for((uint64_t) (sb->num_blocks - sb->checksum_start) * 4, block_size);
+  sb->data_start      = sb->checksum_start + sb->checksum_blocks;
+  if(sb->data_start >= sb->num_blocks)
+    return -1;
+  
+  // Each group has as many blocks as the block map in its first block has
+  // bits. The checksums of a group then fill whole blocks of the checksum
+  // region, so no two groups mark the same checksum block as modified. A
+  // last group too small to hold any data after its metadata is left out,
+  // leaving its blocks unused.
+  uint32_t data_blocks = sb->num_blocks - sb->data_start;
+  sb->group_blocks = block_size * 8;
+  sb->num_groups   = blocks_for(data_blocks, sb->group_blocks);
+  while(true) {
+    sb->group_inodes      = (sb->max_files + sb->num_groups - 1) / sb->num_groups;
+    sb->group_inode_start = GROUP_INODE_MAP + blocks_for(BITMAP_WORDS(sb->group_inodes) * 8, block_size);
+    sb->group_meta_blocks = sb->group_inode_start +
+      blocks_for((uint64_t) sb->group_inodes * INODE_SIZE, block_size);
+    if(sb->group_meta_blocks >= sb->group_blocks)
+      return -1;
+    
+    uint32_t last_blocks = data_blocks - (sb->num_groups - 1) * sb->group_blocks;
+    if(last_blocks > sb->group_meta_blocks)
+      return 0;
+    if(sb->num_groups == 1)
+      return -1;
+    sb->num_groups--;
+    data_blocks = sb->num_groups * sb->group_blocks;
+  }
+}
+
+// Return the first block of group g of an image laid out as sb
+static inline uint64_t group_start(const superblock *sb, uint32_t g) {
+  return sb->data_start + (uint64_t) g * sb->group_blocks;
+}
+
+// Return the number of blocks in group g of an image laid out as sb
+static inline uint32_t group_size(const superblock *sb, uint32_t g) {
+  uint64_t end = group_start(sb, g) + sb->group_blocks;
+  return (end < sb->num_blocks ? end : sb->num_blocks) - group_start(sb, g);
+}
+
+// Return the number of inodes in group g of an image laid out as sb that are
+// in use by the image, which can be fewer than group_inodes in the last ones
+static inline uint32_t group_inodes_used(const superblock *sb, uint32_t g) {
+  uint64_t first = (uint64_t) g * sb->group_inodes;
+  if(first >= sb->max_files)
+    return 0;
+  return sb->max_files - first < sb->group_inodes ? sb->max_files - first : sb->group_inodes;
+}
+
+// Create a new image with name name, with an empty directory, every inode
+// and data block free, the geometry given by geometry, and the way space is
+// reserved selected by flags
+static int create_image(char *name, create_flag flags, const mfs_geometry *geometry) {
+  superblock sb = { .magic = FS_MAGIC, .version = FS_VERSION };
+  sb.block_size = geometry && geometry->block_size ? geometry->block_size : DEFAULT_BLOCK_SIZE;
+  sb.num_blocks = geometry && geometry->num_blocks ? geometry->num_blocks : DEFAULT_NUM_BLOCKS;
+  sb.max_files  = geometry && geometry->max_files  ? geometry->max_files  : DEFAULT_MAX_FILES;
+  if(flags & FS_DEDUP)
+    sb.flags |= IMAGE_DEDUP;
+  if(flags & FS_COMPRESS)
+    sb.flags |= IMAGE_COMPRESS;
+  sb.flags |= IMAGE_CHECKSUMS;
+  
+  if(sb.block_size < MIN_BLOCK_SIZE || sb.block_size > MAX_BLOCK_SIZE || (sb.block_size & (sb.block_size - 1)) != 0) {
+    printf("createfs error: Block size must be a power of two from %d to %d\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+    return -1;
+  }
+  if(sb.num_blocks > MAX_NUM_BLOCKS) {
+    printf("createfs error: Block count must be at most %d\n", MAX_NUM_BLOCKS);
+    return -1;
+  }
+  if(plan_layout(&sb) == -1) {
+    printf("createfs error: %u blocks is not enough to hold %u inodes\n", sb.num_blocks, sb.max_files);
+    return -1;
+  }
+  
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if(fd == -1) {
+    printf("createfs error: Could not open file \"%s\": ", name);
+    fflush(stdout);
+    perror("");
+    return -1;
+  }
+  
+  // Only the superblock, the free maps of each group and the inode of the
+  // root directory are written. The checksum region, the other inodes and
+  // the data blocks are all zeros to start with, which a hole in the file
+  // reads back as. That includes the first data block, which holds the
+  // root directory as an empty leaf.
+  uint32_t map_blocks = sb.group_inode_start;
+  size_t map_size = (size_t) map_blocks * sb.block_size;
+  printf("Writing %zu bytes to %s\n", sb.block_size + sb.num_groups * map_size + sizeof(inode), name);
+  
+  uint8_t *block = calloc(1, sb.block_size);
+  memcpy(block, &sb, sizeof(sb));
+  int status = write_all(fd, block, sb.block_size, 0);
+  free(block);
+  
+  // Set all inodes of each group to free (1), and all of its blocks other
+  // than its metadata blocks to free (1), apart from the inode and block of
+  // the root directory in the first group
+  uint8_t *maps = malloc(map_size);
+  for(uint32_t g = 0; g < sb.num_groups && status == 0; g++) {
+    memset(maps, 0, map_size);
+    bitmap_set_range((uint64_t *) maps, sb.group_meta_blocks, group_size(&sb, g) - sb.group_meta_blocks);
+    bitmap_set_range((uint64_t *) (maps + GROUP_INODE_MAP * sb.block_size), 0, group_inodes_used(&sb, g));
+    if(g == 0) {
+      bitmap_clear((uint64_t *) maps, sb.group_meta_blocks);
+      bitmap_clear((uint64_t *) (maps + GROUP_INODE_MAP * sb.block_size), ROOT_INODE);
+    }
+    status = write_all(fd, maps, map_size, group_start(&sb, g) * sb.block_size);
+  }
+  free(maps);
+  
+  inode root = { .bytes = sb.block_size, .time_added = time(NULL), .used_blocks = 1, .flags = INODE_DIR };
+  *dir_root(&root) = group_start(&sb, 0) + sb.group_meta_blocks;
+  if(status == 0)
+    status = write_all(fd, &root, sizeof(root),
+        (group_start(&sb, 0) + sb.group_inode_start) * sb.block_size + ROOT_INODE * INODE_SIZE);
+  
+  // Extend the file to the full size of the image, leaving the data blocks
+  // as a hole unless asked to reserve disk space for all of them now
+  off_t image_size = (off_t) sb.num_blocks * sb.block_size;
+  if(status == 0)
+    status = ftruncate(fd, image_size);
+  if(status == 0 && (flags & FS_PREALLOCATE))
+    status = fallocate(fd, 0, 0, image_size);
+  
+  if(status == -1) {
+    printf("createfs error: Could not write file \"%s\": ", name);
+    fflush(stdout);
+    perror("");
+  }
+
+  // Close the output file, we're done. 
+  close(fd);
+  
+  // A journal left over from an image that used to have this name
+  // must not be replayed into the new one
+  if(status == 0) {
+    char *old_journal = journal_path(name);
+    unlink(old_journal);
+    free(old_journal);
+  }
+  
+  return status;
+}
+
+int mfs_createfs(char *name, create_flag flags, const mfs_geometry *geometry) {
+  uint64_t start = stats_start();
+  int status = create_image(name, flags, geometry);
+  stats_record(STATS_CREATEFS, start, status, 0);
+  return status;
+}
+
+// Write every block that has been committed to the journal from memory back
+// into the image file, and then empty the journal. This must only be done
+// right after a commit, when the blocks in memory match the journal.
+static int checkpoint(mfs_t *h) {
+  int fd = h->image_fd;
+  if(fd == -1) {
+    fd = open(h->disk_image_name, O_WRONLY | O_CREAT, 0644);
+    if(fd == -1)
+      return -1;
+  }
+  
+  // If the image file was removed or replaced since it was opened,
+  // every block has to be written to recreate it
+  int status = 0;
+  struct stat buf;
+  if(fstat(fd, &buf) == -1 || buf.st_size != (off_t) image_size(h)) {
+    memset(h->journaled_blocks, true, h->num_blocks);
+    status = ftruncate(fd, image_size(h));
+  }
+
+  // Merge each run of adjacent blocks into a single write
+  int block_index = 0;
+  while(block_index < h->num_blocks && status == 0) {
+    if(!h->journaled_blocks[block_index]) {
+      block_index++;
+      continue;
+    }
+    
+    int run_start = block_index;
+    while(block_index < h->num_blocks && h->journaled_blocks[block_index])
+      block_index++;
+    
+    size_t len = (size_t) (block_index - run_start) * h->block_size;
+    status = write_all(fd, block_at(h, run_start), len, (off_t) run_start * h->block_size);
+  }
+  
+  // Only empty the journal once the image is safely on disk. If we crash
+  // before then, the journal is replayed again the next time it is opened.
+  if(status == 0)
+    status = fdatasync(fd);
+  if(status == 0)
+    status = ftruncate(h->journal_fd, 0);
+  
+  if(status == 0) {
+    h->journal_size = 0;
+    h->journaled_count = 0;
+    memset(h->journaled_blocks, false, h->num_blocks);
+  }
+  
+  if(h->image_fd == -1)
+    close(fd);
+  return status;
+}
+
+// Create the journal file for the opened image
+static int create_journal(mfs_t *h) {
+  h->journal_fd = open(h->journal_name, O_RDWR | O_CREAT, 0644);
+  if(h->journal_fd == -1)
+    return -1;
+  
+  // Flush the directory holding the journal, so that the journal itself
+  // isn't lost in a crash along with everything committed to it
+  char *dir_name = strdup(h->journal_name);
+  int dir_fd = open(dirname(dir_name), O_RDONLY);
+  if(dir_fd != -1) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+  free(dir_name);
+  return 0;
+}
+
+// Save the currently opened filesystem in the current
+// directory with the value of disk_image_name as its name.
+// Every block modified since the last save is committed to the journal
+// as one transaction, so any number of operations are made durable
+// together with a single flush. The blocks are written back into the
+// image itself once enough of them have built up in the journal.
+static int save_image(mfs_t *h) {
+  uint32_t *numbers = malloc(h->num_blocks * sizeof(uint32_t));
+  uint8_t **blocks = malloc(h->num_blocks * sizeof(uint8_t *));
+  int count = 0;
+  for(int i = 0; i < h->num_blocks; i++) {
+    if(h->dirty_blocks[i]) {
+      numbers[count] = i;
+      blocks[count] = block_at(h, i);
+      count++;
+    }
+  }
+  
+  printf("Writing %zu bytes to %s\n", (size_t) count * h->block_size, h->journal_name);
+  
+  int status = 0;
+  if(count > 0) {
+    if(h->journal_fd == -1)
+      status = create_journal(h);
+    if(status == 0)
+      status = journal_append(h->journal_fd, &h->journal_size, h->journal_sequence, numbers, blocks,
+          count, h->block_size);
+  }
+  free(numbers);
+  free(blocks);
+  
+  if(status == -1) {
+    printf("savefs error: Could not write file \"%s\": ", h->journal_name);
+    fflush(stdout);
+    perror("");
+    return -1;
+  }
+  
+  // The transaction is committed, so the blocks are no longer dirty
+  // but still have to be written back into the image
+  h->journal_sequence++;
+  for(int i = 0; i < h->num_blocks; i++) {
+    if(h->dirty_blocks[i] && !h->journaled_blocks[i]) {
+      h->journaled_blocks[i] = true;
+      h->journaled_count++;
+    }
+  }
+  memset(h->dirty_blocks, false, h->num_blocks);
+  
+  if(h->journaled_count >= JOURNAL_CHECKPOINT_BLOCKS && checkpoint(h) == -1) {
+    printf("savefs error: Could not write file \"%s\": ", h->disk_image_name);
+    fflush(stdout);
+    perror("");
+    return -1;
+  }
+
+  return 0;
+}
+
+// Save the filesystem of h. Every other operation on h is waited for and
+// kept out until it is done, so each save holds a consistent image.
+int mfs_savefs(mfs_t *h) {
+  uint64_t start = stats_start();
+  pthread_rwlock_wrlock(&h->image_lock);
+  int status = save_image(h);
+  pthread_rwlock_unlock(&h->image_lock);
+  stats_record(STATS_SAVEFS, start, status, 0);
+  return status;
+}
+
+// Set attribute (a) in file with filename (filename) to either
+// enabled or disabled
+int mfs_setattrib(mfs_t *h, char *filename, attrib a, bool enabled) {
+  uint64_t start = stats_start();
+  pthread_rwlock_rdlock(&h->image_lock);
+  pthread_rwlock_rdlock(&h->dir_lock);
+  
+  int status = -1;
+  dir_entry *entry = lookup_entry(h, filename, NULL);
+  if(entry == NULL && errno == ENOENT) {
+    printf("attrib error: Could not find file with name \"%s\"\n", filename);
+  } else if(entry == NULL) {
+    print_path_error("attrib", filename);
+  } else {
+    // Set specific bit in attrib associated with either hidden or
+    // read-only to enabled/disabled
+    int inode_idx = entry->inode;
+    pthread_rwlock_wrlock(&h->inode_locks[inode_idx]);
+    if(enabled)
+      h->inodes[inode_idx]->attrib |=  a & 0b11;
+    else
+      h->inodes[inode_idx]->attrib &= ~a & 0b11;
+    mark_dirty(h, h->inodes[inode_idx]);
+    pthread_rwlock_unlock(&h->inode_locks[inode_idx]);
+    status = 0;
+  }
+  
+  pthread_rwlock_unlock(&h->dir_lock);
+  pthread_rwlock_unlock(&h->image_lock);
+  stats_record(STATS_ATTRIB, start, status, 0);
+  return status;
+}
+
+// Read the image file with name filename into memory owned by h
+static int read_image(mfs_t *h, char *filename, off_t copy_size) {
+  // Open the input file read-only 
+  FILE *ofp = fopen(filename, "r"); 
+  if(ofp == NULL) {
+    printf("open error: Could not open file \"%s\": ", filename);
+    fflush(stdout);
+    perror("");
+    return -1;
+  }
+  
+  void *memory;
+  if(posix_memalign(&memory, 64, copy_size) != 0) {
+    printf("open error: Not enough memory to hold the image\n");
+    fclose(ofp);
+    return -1;
+  }
+  h->blocks = memory;
+  printf("Reading %ld bytes from %s\n", (long) copy_size, filename);
+
+  // We want to copy and write in chunks of block_size. So to do this 
+  // we are going to use fseek to move along our file stream in chunks of block_size.
+  // We will copy bytes, increment our file pointer by block_size and repeat.
+  off_t offset    = 0;               
+
+  // We are going to copy and store our file in block_size chunks instead of one big 
+  // memory pool. Why? We are simulating the way the file system stores file data in
+  // blocks of space on the disk. block_index will keep us pointing to the area of
+  // the area that we will read from or write to.
+  int block_index = 0;
+  
+  // copy_size is initialized to the size of the input file so each loop iteration we
+  // will copy block_size bytes from the file then reduce our copy_size counter by
+  // block_size number of bytes. When copy_size is less than or equal to zero we know
+  // we have copied all the data from the input file.
+  while(copy_size > 0) {
+
+    // Index into the input file by offset number of bytes.  Initially offset is set to
+    // zero so we copy block_size number of bytes from the front of the file.  We 
+    // then increase the offset by block_size and continue the process.  This will
+    // make us copy from offsets 0, block_size, 2*block_size, 3*block_size, etc.
+    fseeko(ofp, offset, SEEK_SET);
+
+    // Read block_size number of bytes from the input file and store them in our
+    // data array. 
+    int bytes  = fread(block_at(h, block_index), h->block_size, 1, ofp);
+
+    // If bytes == 0 and we haven't reached the end of the file then something is 
+    // wrong. If 0 is returned and we also have the EOF flag set then that is OK.
+    // It means we've reached the end of our input file.
+    if(bytes == 0 && !feof(ofp)) {
+      printf("open error: An error occured reading from the input file\n");
+      fclose(ofp);
+      free(h->blocks);
+      h->blocks = NULL;
+      return -1;
+    }
+
+    // Clear the EOF file flag.
+    clearerr(ofp);
+
+    // Reduce copy_size by the block_size bytes.
+    copy_size -= h->block_size;
+    
+    // Increase the offset into our input file by block_size.  This will allow
+    // the fseek at the top of the loop to position us to the correct spot.
+    offset    += h->block_size;
+
+    // Increment the index into the block array 
+    block_index++;
+  }
+
+  // We are done copying from the input file so close it out.
+  fclose(ofp);
+  return 0;
+}
+
+// Map the image file with name filename into memory so that the
+// file itself is used as the block array. Pages are only read in
+// from disk when they are first touched. The mapping is private so
+// that changes only ever reach the file through the journal.
+static int map_image(mfs_t *h, char *filename, off_t copy_size) {
+  int fd = open(filename, O_RDWR);
+  if(fd == -1) {
+    printf("open error: Could not open file \"%s\": ", filename);
+    fflush(stdout);
+    perror("");
+    return -1;
+  }
+  
+  void *map = mmap(NULL, copy_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(map == MAP_FAILED) {
+    printf("open error: Could not map file \"%s\": ", filename);
+    fflush(stdout);
+    perror("");
+    close(fd);
+    return -1;
+  }
+  printf("Mapped %ld bytes from %s\n", (long) copy_size, filename);
+  
+  h->blocks = map;
+  h->image_fd = fd;
+  return 0;
+}
+
+// Release the block array of h, discarding any unsaved changes
+static void release_blocks(mfs_t *h) {
+  if(h->image_fd != -1) {
+    munmap(h->blocks, image_size(h));
+    close(h->image_fd);
+    h->image_fd = -1;
+  } else {
+    free(h->blocks);
+  }
+  h->blocks = NULL;
+}
+
+// Allocate a handle with nothing opened yet for an image laid out as sb
+static mfs_t *new_handle(const superblock *sb) {
+  mfs_t *h = calloc(1, sizeof(mfs_t));
+  h->image_fd = -1;
+  h->journal_fd = -1;
+  
+  h->block_size  = sb->block_size;
+  h->num_blocks  = sb->num_blocks;
+  h->max_files   = sb->max_files;
+  h->data_start  = sb->data_start;
+  h->node_entries = (h->block_size - sizeof(extent_node)) / sizeof(extent);
+  h->dir_leaf_entries = (h->block_size - sizeof(dir_node)) / sizeof(dir_entry);
+  h->dir_node_entries = (h->block_size - sizeof(dir_node)) / sizeof(dir_index);
+  h->group_blocks = sb->group_blocks;
+  h->group_inodes = sb->group_inodes;
+  h->group_meta_blocks = sb->group_meta_blocks;
+  h->group_inode_start = sb->group_inode_start;
+  h->num_groups   = sb->num_groups;
+  
+  h->inodes           = malloc(h->max_files * sizeof(inode *));
+  h->dirty_blocks     = calloc(h->num_blocks, sizeof(bool));
+  h->journaled_blocks = calloc(h->num_blocks, sizeof(bool));
+  h->inode_locks      = malloc(h->max_files * sizeof(pthread_rwlock_t));
+  h->groups           = calloc(h->num_groups, sizeof(alloc_group));
+  
+  pthread_rwlock_init(&h->image_lock, NULL);
+  pthread_rwlock_init(&h->dir_lock, NULL);
+  for(int i = 0; i < h->max_files; i++)
+    pthread_rwlock_init(&h->inode_locks[i], NULL);
+  pthread_mutex_init(&h->dedup_lock, NULL);
+  for(int i = 0; i < h->num_groups; i++) {
+    alloc_group *g = &h->groups[i];
+    pthread_mutex_init(&g->lock, NULL);
+    g->first_block = group_start(sb, i);
+    g->num_blocks  = group_size(sb, i);
+    g->first_inode = i * sb->group_inodes;
+    g->num_inodes  = group_inodes_used(sb, i);
+  }
+  return h;
+}
+
+// Free a handle allocated by new_handle
+static void free_handle(mfs_t *h) {
+  pthread_rwlock_destroy(&h->image_lock);
+  pthread_rwlock_destroy(&h->dir_lock);
+  for(int i = 0; i < h->max_files; i++)
+    pthread_rwlock_destroy(&h->inode_locks[i]);
+  pthread_mutex_destroy(&h->dedup_lock);
+  for(int i = 0; i < h->num_groups; i++)
+    pthread_mutex_destroy(&h->groups[i].lock);
+  free(h->groups);
+  free(h->inodes);
+  free(h->dirty_blocks);
+  free(h->journaled_blocks);
+  free(h->inode_locks);
+  free(h);
+}
+
+// Read the superblock of the image file with name filename into sb, and
+// check that it describes an image this version can open
+static int read_superblock(char *filename, superblock *sb) {
+  int fd = open(filename, O_RDONLY);
+  if(fd == -1) {
+    printf("open error: Could not open file \"%s\": ", filename);
+    fflush(stdout);
+    perror("");
+    return -1;
+  }
+  
+  int status = read_all(fd, sb, sizeof(superblock), 0);
+  close(fd);
+  
+  // The regions must be where this version would have put them
+  superblock layout = { 0 };
+  layout.block_size = sb->block_size;
+  layout.num_blocks = sb->num_blocks;
+  layout.max_files  = sb->max_files;
+  if(status == -1 || sb->magic != FS_MAGIC || sb->version != FS_VERSION ||
+      !(sb->flags & IMAGE_CHECKSUMS) || plan_layout(&layout) == -1 ||
+      memcmp(&sb->checksum_start, &layout.checksum_start,
+        sizeof(superblock) - offsetof(superblock, checksum_start)) != 0) {
+    printf("open error: Image is not a supported file system image\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Open file on system with name filename as a new filesystem handle, using
+// the backend selected by flags. Returns NULL if it could not be opened.
+static mfs_t *open_image(char *filename, open_flag flags) {
+  if(strnlen(filename, MAX_FILENAME+1) > MAX_FILENAME) {
+    printf("open error: File name too long\n");
+    return NULL;
+  }
+  
+  int    status;                   // Hold the status of all return values.
+  struct stat buf;                 // stat struct to hold the returns from the stat call
+
+  // Call stat with out input filename to verify that the file exists.  It will also 
+  // allow us to get the file size. We also get interesting file system info about the
+  // file such as inode number, block size, and number of blocks.  For now, we don't 
+  // care about anything but the filesize.
+  status =  stat(filename, &buf); 
+
+  // If stat did return -1 then we know the input file doesn't exists or we can't use it.
+  if(status == -1) {
+    printf("open error: Failed to read file\n");
+    return NULL;
+  }
+  
+  // The superblock gives the geometry, which the rest of the image is laid out by
+  superblock sb;
+  if(read_superblock(filename, &sb) == -1)
+    return NULL;
+  
+  // Save off the size of the input file since we'll use it in a couple of places and 
+  // also initialize our index variables to zero. 
+  off_t copy_size = buf.st_size;
+  
+  if(copy_size != (off_t) sb.num_blocks * sb.block_size) {
+    printf("open error: Image is not correct size\n");
+    return NULL;
+  }
+  
+  mfs_t *h = new_handle(&sb);
+  
+  // Bring the image file up to date with the journal before loading it
+  if(replay_journal(h, filename) == -1) {
+    free_handle(h);
+    return NULL;
+  }
+  
+  if(flags & FS_MMAP)
+    status = map_image(h, filename, copy_size);
+  else
+    status = read_image(h, filename, copy_size);
+  if(status == -1) {
+    close_journal(h);
+    free_handle(h);
+    return NULL;
+  }
+
+  h->disk_image_name = strndup(filename, MAX_FILENAME+1);
+  
+  // Setup each inode to point to its slot in the inode table of its group
+  int inodes_per_block = h->block_size / INODE_SIZE;
+  for(int i = 0; i < h->max_files; i++) {
+    alloc_group *g = inode_group(h, i);
+    int slot = i - g->first_inode;
+    h->inodes[i] = (inode *) (block_at(h, g->first_block + h->group_inode_start + slot / inodes_per_block) +
+        slot % inodes_per_block * INODE_SIZE);
+  }
+  
+  // Setup the free maps of each group by making them point
+  // to the correct blocks within the filesystem
+  for(int i = 0; i < h->num_groups; i++) {
+    alloc_group *g = &h->groups[i];
+    g->block_map = (uint64_t *) block_at(h, g->first_block);
+    g->inode_map = (uint64_t *) block_at(h, g->first_block + GROUP_INODE_MAP);
+  }
+  
+  // Every path starts from the root directory, so there has to be one
+  inode *root = h->inodes[ROOT_INODE];
+  if(inode_free(h, ROOT_INODE) || !(root->flags & INODE_DIR) || !data_block(h, *dir_root(root))) {
+    printf("open error: Image has no root directory\n");
+    close_journal(h);
+    release_blocks(h);
+    free(h->disk_image_name);
+    free_handle(h);
+    return NULL;
+  }
+  count_free(h);
+  count_block_refs(h);
+  h->dedup = sb.flags & IMAGE_DEDUP;
+  h->compress = sb.flags & IMAGE_COMPRESS;
+  h->checksums = (uint32_t *) block_at(h, sb.checksum_start);
+  
+  // The image was just loaded, so nothing differs from the file yet
+  memset(h->dirty_blocks, false, h->num_blocks);
+  
+  return h;
+}
+
+mfs_t *mfs_open(char *filename, open_flag flags) {
+  uint64_t start = stats_start();
+  mfs_t *h = open_image(filename, flags);
+  stats_record(STATS_OPEN, start, h ? 0 : -1, 0);
+  return h;
+}
+
+// Close the filesystem of h and free the handle. Nothing else may be
+// using h while it is closed, or after.
+int mfs_close(mfs_t *h) {
+  uint64_t start = stats_start();
+  
+  // If everything has been saved, write the journal back into the image now.
+  // Otherwise the blocks in memory may not match the journal, so leave it to
+  // be replayed the next time the image is opened.
+  if(h->journaled_count > 0 && memchr(h->dirty_blocks, true, h->num_blocks) == NULL)
+    checkpoint(h);
+  close_journal(h);
+  
+  release_blocks(h);
+  if(h->dedup_built)
+    free_dedup_index(h);
+  free(h->block_refs);
+  free(h->disk_image_name);
+  free_handle(h);
+  
+  stats_record(STATS_CLOSE, start, 0, 0);
+  return 0;
+}
+
+// List all files not marked as deleted in the directory dir_name, or the
+// root directory if it is NULL. Directories end with a '/'. Only show
+// hidden files if show_hidden is true
+int mfs_list(mfs_t *h, char *dir_name, bool show_hidden) {
+  uint64_t start = stats_start();
+  pthread_rwlock_rdlock(&h->image_lock);
+  pthread_rwlock_rdlock(&h->dir_lock);
+  
+  int dir_idx = lookup_dir(h, "list", dir_name);
+  for(dir_node *leaf = dir_idx != -1 ? first_leaf(h, h->inodes[dir_idx]) : NULL; leaf != NULL; leaf = next_leaf(h, leaf)) {
+    dir_entry *entries = (dir_entry *) dir_items(leaf);
+    for(int i = 0; i < leaf->num_entries; i++) {
+      if(entries[i].state != ENTRY_VALID || entries[i].inode >= h->max_files)
+        continue;
+      
+      int inode_idx = entries[i].inode;
+      inode *node = h->inodes[inode_idx];
+      pthread_rwlock_rdlock(&h->inode_locks[inode_idx]);
+      
+      // Check that the current file is not hidden, unless we are
+      // meant to show hidden files
+      if(!(node->attrib & H) || show_hidden) {
+        char time_str[26];
+        ctime_r(&node->time_added, time_str);
+        time_str[strlen(time_str)-1] = 0; // Remove newline character from string
+        printf("%8ld %s %.*s%s\n", (long) node->bytes, time_str, MAX_FILENAME, entries[i].filename,
+            node->flags & INODE_DIR ? "/" : "");
+      }
+      pthread_rwlock_unlock(&h->inode_locks[inode_idx]);
+    }
+  }
+  
+  pthread_rwlock_unlock(&h->dir_lock);
+  pthread_rwlock_unlock(&h->image_lock);
+  int status = dir_idx == -1 ? -1 : 0;
+  stats_record(STATS_LIST, start, status, 0);
+  return status;
+}
+
+// Return true if files put into h only have their blocks taken as they are
+// read, since dedup and compression make the number needed unknown before
+static bool blocks_taken_on_read(mfs_t *h) {
+  return h->dedup || h->compress;
+}
+
+// Return true if a file of size bytes is small enough to be kept inline
+static inline bool fits_inline(off_t size) {
+  return size <= (off_t) INLINE_DATA_SIZE;
+}
+
+// Drop the reference of the file node to each of its blocks, the blocks of
+// its extent tree or the nodes of a directory included, and give back its
+// inode inode_idx. The inode is given back last, so once it shows up as free
+// the blocks have all been dropped and nothing reads the inode any longer.
+// In dedup mode the caller must hold dedup_lock.
+static void release_file(mfs_t *h, int inode_idx) {
+  unref_file(h, h->inodes[inode_idx]);
+  if(h->inodes[inode_idx]->flags & INODE_DIR)
+    free_dir_nodes(h, *dir_root(h->inodes[inode_idx]));
+  
+  alloc_group *g = inode_group(h, inode_idx);
+  pthread_mutex_lock(&g->lock);
+  set_inode_free(h, inode_idx, true);
+  check_free_counts(g);
+  pthread_mutex_unlock(&g->lock);
+}
+
+// Set up inode inode_idx, just taken by take_inode, for a file of copy_size
+// bytes and take enough free blocks for it, in as few contiguous extents as
+// the free space allows. The blocks are taken from the group of the inode
+// first. No blocks are taken when blocks_taken_on_read, since store_file
+// takes them as the file is read, nor for a file that fits inline, which is
+// marked as inline instead. In dedup mode the caller must hold
+// dedup_lock. Returns -1 with errno set if the blocks don't fit, leaving
+// the inode to be released.
+static int alloc_file_blocks(mfs_t *h, int inode_idx, off_t copy_size) {
+  // Clear all values in the inode and set file size in bytes,
+  // time added, and set attributes to none
+  inode *node = h->inodes[inode_idx];
+  memset(node, 0, INODE_SIZE);
+  node->bytes = copy_size;
+  node->time_added = time(NULL);
+  node->attrib = 0;
+  mark_dirty(h, node);
+  
+  if(fits_inline(copy_size)) {
+    node->flags = INODE_INLINE;
+    return 0;
+  }
+  
+  off_t remaining_blocks = blocks_taken_on_read(h) ? 0 : (copy_size + h->block_size - 1) / h->block_size;
+  while(remaining_blocks > 0) {
+    extent e;
+    int want = remaining_blocks < h->num_blocks ? remaining_blocks : h->num_blocks;
+    if(alloc_extent(h, home_group(h, node), want, &e) == 0) {
+      errno = ENOSPC;
+      return -1;
+    }
+    if(add_extent(h, node, e.start, e.length) == -1) {
+      unref_extent_locked(h, &e);
+      return -1;
+    }
+    node->used_blocks += e.length;
+    remaining_blocks  -= e.length;
+  }
+  return 0;
+}
+
+// Take a free inode and enough free blocks for a file of copy_size bytes.
+// Returns the index of the inode, or -1 if the file doesn't fit.
+static int alloc_file(mfs_t *h, off_t copy_size) {
+  lock_dedup(h);
+  
+  // If the size of the file is greater than the available space left,
+  // we cannot fit this file. Return failure. In dedup and compress mode
+  // the file may need less space than its size, which is only known once
+  // it has been read. Other files can take blocks at the same time, so the
+  // blocks can still run out while they are taken.
+  int inode_idx = -1;
+  off_t free_bytes = (off_t) __atomic_load_n(&h->free_block_count, __ATOMIC_RELAXED) * h->block_size;
+  if(!blocks_taken_on_read(h) && !fits_inline(copy_size) && copy_size > free_bytes)
+    printf("put error: Not enough disk space\n");
+  else if((inode_idx = take_inode(h)) == -1)
+    printf("put error: Maximum amount of inodes has been reached (%d)\n", h->max_files);
+  
+  if(inode_idx != -1 && alloc_file_blocks(h, inode_idx, copy_size) == -1) {
+    if(errno == EFBIG)
+      printf("put error: File is too large for its extent tree\n");
+    else
+      printf("put error: Not enough disk space\n");
+    release_file(h, inode_idx);
+    inode_idx = -1;
+  }
+  
+  unlock_dedup(h);
+  return inode_idx;
+}
+
+// Give back the inode of inode_idx and its reference to each of its blocks
+static void free_file(mfs_t *h, int inode_idx) {
+  lock_dedup(h);
+  release_file(h, inode_idx);
+  unlock_dedup(h);
+}
+
+// Add a block holding the block_size bytes of data to the end of the file
+// node. In dedup mode a block in the image already holding the same data,
+// which has fingerprint fp, is shared, otherwise a new block is taken for it,
+// from the group of the inode first. In dedup mode the caller must hold
+// dedup_lock. Returns -1 with errno set to ENOSPC if a new block is needed
+// and none are free, or to EFBIG if the extent tree of the file has no room
+// for another extent.
+static int append_block(mfs_t *h, inode *node, const uint8_t *data, uint64_t fp) {
+  extent e;
+  int block = h->dedup ? find_dedup_block(h, data, fp) : -1;
+  if(block != -1) {
+    e = (extent) { 0, block, 1 };
+    ref_extent_locked(h, &e);
+  } else if(alloc_extent(h, home_group(h, node), 1, &e) == 1) {
+    block = e.start;
+    memcpy(block_at(h, block), data, h->block_size);
+    mark_dirty_blocks(h, block, 1);
+    update_checksums(h, &e);
+    if(h->dedup)
+      link_dedup_block(h, block, fp);
+  } else {
+    errno = ENOSPC;
+    return -1;
+  }
+  
+  // Grow the last extent if the block follows right after it
+  extent *last = last_extent(h, node);
+  if(last && last->start + last->length == block && last->length < UINT32_MAX) {
+    last->length++;
+    mark_dirty(h, last);
+  } else if(add_extent(h, node, block, 1) == -1) {
+    unref_extent_locked(h, &e);
+    return -1;
+  }
+  node->used_blocks++;
+  return 0;
+}
+
+// The blocks of a new file being written by store_file, gathered in batch
+// until there are STORE_BATCH_BLOCKS of them to add at once
+typedef struct {
+  mfs_t *h;
+  inode *node;
+  uint8_t *batch;
+  int len;                            // Number of bytes in batch
+} block_writer;
+
+// Add the bytes gathered in the batch of w to the end of its file, padding
+// the last block with zeros. In dedup mode the blocks are fingerprinted
+// before the dedup index is locked to look them up.
+static int flush_blocks(block_writer *w) {
+  mfs_t *h = w->h;
+  int num_blocks = (w->len + h->block_size - 1) / h->block_size;
+  memset(w->batch + w->len, 0, num_blocks * h->block_size - w->len);
+  
+  uint64_t fingerprints[STORE_BATCH_BLOCKS] = { 0 };
+  if(h->dedup) {
+    for(int i = 0; i < num_blocks; i++)
+      fingerprints[i] = fingerprint_block(w->batch + i * h->block_size, h->block_size);
+  }
+  
+  int status = 0;
+  lock_dedup(h);
+  if(h->dedup && !h->dedup_built)
+    build_dedup_index(h);
+  for(int i = 0; i < num_blocks && status == 0; i++)
+    status = append_block(h, w->node, w->batch + i * h->block_size, fingerprints[i]);
+  unlock_dedup(h);
+  
+  w->len = 0;
+  return status;
+}
+
+// Add len bytes of data to the end of the file of w
+static int write_blocks(block_writer *w, const void *data, int len) {
+  const uint8_t *p = data;
+  while(len > 0) {
+    int n = STORE_BATCH_BLOCKS * w->h->block_size - w->len;
+    if(n > len)
+      n = len;
+    memcpy(w->batch + w->len, p, n);
+    w->len += n;
+    p      += n;
+    len    -= n;
+    if(w->len == STORE_BATCH_BLOCKS * w->h->block_size && flush_blocks(w) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+// Read copy_size bytes from ifd into the new file with inode inode_idx when
+// blocks_taken_on_read. In compress mode the file is compressed a chunk at a
+// time, with the chunks packed one after another into the blocks. In dedup
+// mode blocks are only taken for data that isn't in the image yet.
+static int store_file(mfs_t *h, int ifd, int inode_idx, off_t copy_size) {
+  inode *node = h->inodes[inode_idx];
+  block_writer w = { h, node, malloc(STORE_BATCH_BLOCKS * h->block_size), 0 };
+  uint8_t *chunk = malloc(COMPRESS_CHUNK_SIZE);
+  uint8_t *packed = h->compress ? malloc(COMPRESS_CHUNK_SIZE) : NULL;
+  
+  int status = 0;
+  uint64_t packed_bytes = 0;
+  for(off_t offset = 0; offset < copy_size && status == 0; offset += COMPRESS_CHUNK_SIZE) {
+    int len = copy_size - offset < COMPRESS_CHUNK_SIZE ? copy_size - offset : COMPRESS_CHUNK_SIZE;
+    
+    status = read_all(ifd, chunk, len, offset);
+    if(status == 0 && h->compress) {
+      uint32_t header = lz_compress(chunk, len, packed, len - 1);
+      uint8_t *data = packed;
+      if(header == 0) {
+        header = len | CHUNK_RAW;
+        data = chunk;
+      }
+      status = write_blocks(&w, &header, sizeof(header));
+      if(status == 0)
+        status = write_blocks(&w, data, header & ~CHUNK_RAW);
+      packed_bytes += sizeof(header) + (header & ~CHUNK_RAW);
+    } else if(status == 0) {
+      status = write_blocks(&w, chunk, len);
+    }
+  }
+  if(status == 0 && w.len > 0)
+    status = flush_blocks(&w);
+  
+  node->packed_bytes = h->compress ? packed_bytes : 0;
+  mark_dirty(h, node);
+  free(w.batch);
+  free(chunk);
+  free(packed);
+  return status;
+}
+
+// Read copy_size bytes from ifd into the blocks already taken for the new
+// file with inode inode_idx
+static int read_extents(mfs_t *h, int ifd, int inode_idx, off_t copy_size) {
+  inode *node = h->inodes[inode_idx];
+  
+  // Read each extent straight from the input file into its blocks with a
+  // single read, since the blocks of an extent are consecutive in the
+  // filesystem as well
+  off_t remaining = copy_size;
+  extent_walk w;
+  start_walk(&w, h, node, false);
+  for(extent *e; (e = next_extent(&w)) != NULL; ) {
+    size_t num_bytes = (size_t) e->length * h->block_size;
+    if(remaining < num_bytes)
+      num_bytes = remaining;
+    
+    if(read_all(ifd, block_at(h, e->start), num_bytes, copy_size - remaining) == -1)
+      return -1;
+    
+    // Clear whatever was left past the end of the file in the last block
+    memset(block_at(h, e->start) + num_bytes, 0, (size_t) e->length * h->block_size - num_bytes);
+    
+    mark_dirty_blocks(h, e->start, e->length);
+    update_checksums(h, e);
+    remaining -= num_bytes;
+  }
+  return 0;
+}
+
+// Read copy_size bytes from ifd into the blocks of the new file with inode
+// inode_idx, or into the inode itself if the file is inline. Nothing else can
+// see the file yet, so no locks are needed. Returns -1 with errno set to
+// ENOSPC or EFBIG if the file didn't fit in the image or its extent tree in
+// dedup or compress mode.
+static int read_file(mfs_t *h, int ifd, int inode_idx, off_t copy_size) {
+  int status;
+  inode *node = h->inodes[inode_idx];
+  if(node->flags & INODE_INLINE)
+    status = read_all(ifd, inline_data(node), copy_size, 0);
+  else if(blocks_taken_on_read(h))
+    status = store_file(h, ifd, inode_idx, copy_size);
+  else
+    status = read_extents(h, ifd, inode_idx, copy_size);
+  
+  // Keep a checksum of the whole file, which undel uses to tell whether
+  // any of its blocks have been given to another file since it was deleted
+  if(status == 0) {
+    update_tree_checksums(h, node);
+    node->checksum = file_checksum(h, node);
+  }
+  return status;
+}
+
+// Put a file currently on the system into the filesystem. The directory is
+// only locked while the dir entry is taken and filled in, so any number of
+// puts can read their files in at the same time. Returns the size of the
+// file, or -1 if it could not be put.
+static long put_file(mfs_t *h, char *filename, char *newfilename) {
+  pthread_rwlock_rdlock(&h->image_lock);
+  
+  // Find the directory the file goes into, then check that no other file
+  // with the same name exists (only checks undeleted files) or is being
+  // added right now, and hold on to a dir entry for it until the file is
+  // in place
+  pthread_rwlock_wrlock(&h->dir_lock);
+  char *path = newfilename != NULL ? newfilename : filename;
+  char name[MAX_FILENAME+1];
+  int dir_idx = lookup_parent(h, path, name);
+  bool reserved = false;
+  if(dir_idx == -1) {
+    print_path_error("put", path);
+  } else {
+    lock_dedup(h);
+    reserved = reserve_entry(h, dir_idx, name) == 0;
+    unlock_dedup(h);
+    if(!reserved)
+      print_entry_error("put", name);
+  }
+  pthread_rwlock_unlock(&h->dir_lock);
+  
+  int    status = -1;              // Hold the status of all return values.
+  int    inode_idx = -1;
+  int    ifd = -1;
+  struct stat buf;                 // stat struct to hold the returns from the stat call
+
+  // Call stat with out input filename to verify that the file exists.  It will also 
+  // allow us to get the file size. We also get interesting file system info about the
+  // file such as inode number, block size, and number of blocks.  For now, we don't 
+  // care about anything but the filesize.
+  // If stat did return -1 then we know the input file doesn't exists or we can't use it.
+  if(reserved && stat(filename, &buf) == -1)
+    printf("put error: Failed to read file\n");
+  else if(reserved)
+    inode_idx = alloc_file(h, buf.st_size);
+  
+  // Open the input file read-only, and let the kernel know we'll be
+  // reading it from start to end so it can read ahead aggressively
+  if(inode_idx != -1) {
+    ifd = open(filename, O_RDONLY); 
+    if(ifd == -1) {
+      printf("put error: Could not open file \"%s\": ", filename);
+      fflush(stdout);
+      perror("");
+    }
+  }
+  
+  if(ifd != -1) {
+    posix_fadvise(ifd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    printf("Reading %ld bytes from %s\n", (long) buf.st_size, filename);
+    status = read_file(h, ifd, inode_idx, buf.st_size);
+    if(status == -1 && errno == ENOSPC)
+      printf("put error: Not enough disk space\n");
+    else if(status == -1 && errno == EFBIG)
+      printf("put error: File is too large for its extent tree\n");
+    else if(status == -1)
+      printf("put error: An error occured reading from the input file\n");
+    
+    // We are done copying from the input file so close it out.
+    close(ifd);
+  }
+  
+  // Give back everything that was allocated for the file if it failed
+  if(status == -1 && inode_idx != -1)
+    free_file(h, inode_idx);
+  
+  // Now that the data is in place, set filename, inode index,
+  // and mark the file as valid
+  if(reserved) {
+    pthread_rwlock_wrlock(&h->dir_lock);
+    lock_dedup(h);
+    if(status == 0)
+      commit_entry(h, dir_idx, name, inode_idx);
+    else
+      release_entry(h, dir_idx, name);
+    unlock_dedup(h);
+    pthread_rwlock_unlock(&h->dir_lock);
+  }
+  
+  pthread_rwlock_unlock(&h->image_lock);
+  return status == 0 ? buf.st_size : -1;
+}
+
+// Copy the local file filename into the filesystem at the path newfilename,
+// or at the same path as it has locally if newfilename is NULL
+int mfs_put(mfs_t *h, char *filename, char *newfilename) {
+  uint64_t start = stats_start();
+  long bytes = put_file(h, filename, newfilename);
+  stats_record(STATS_PUT, start, bytes == -1 ? -1 : 0, bytes == -1 ? 0 : bytes);
+  return bytes == -1 ? -1 : 0;
+}
+
+// Run worker with argument job on one thread per processor, but no more
+// than num_items threads, and wait for all of them to finish
+static void run_workers(void *(*worker)(void *), void *job, int num_items) {
+  int num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if(num_workers > MAX_WORKERS)
+    num_workers = MAX_WORKERS;
+  if(num_workers > num_items)
+    num_workers = num_items;
+  if(num_workers < 1)
+    num_workers = 1;
+  
+  pthread_t workers[MAX_WORKERS];
+  for(int i = 0; i < num_workers; i++)
+    pthread_create(&workers[i], NULL, worker, job);
+  for(int i = 0; i < num_workers; i++)
+    pthread_join(workers[i], NULL);
+}
+
+// One file being added by putdir
+typedef struct {
+  char name[MAX_FILENAME+1];          // Name of the file, both in the directory and the filesystem
+  off_t size;                         // Size of the file in bytes
+  bool reserved;                      // True once its dir entry has been taken
+  int inode_idx;                      // The inode allocated for the file
+  int status;                         // 0 once the file has been read in, else -1
+  int error;                          // The errno of the failed read when status is -1
+} putdir_file;
+
+// Work shared by the putdir worker threads
+typedef struct {
+  mfs_t *h;
+  int dir_fd;                         // The directory the files are read from
+  int dest_idx;                       // Inode of the directory the files are put into
+  putdir_file *files;
+  int num_files;
+  int next_file;                      // Index of the next file for a worker to read
+} putdir_job;
+
+// Read files of job into their blocks until there are none left
+static void *putdir_worker(void *arg) {
+  putdir_job *job = arg;
+  int i;
+  while((i = __atomic_fetch_add(&job->next_file, 1, __ATOMIC_RELAXED)) < job->num_files) {
+    putdir_file *f = &job->files[i];
+    int ifd = openat(job->dir_fd, f->name, O_RDONLY);
+    if(ifd == -1) {
+      f->error = errno;
+      continue;
+    }
+    
+    posix_fadvise(ifd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    f->status = read_file(job->h, ifd, f->inode_idx, f->size);
+    f->error = errno;
+    close(ifd);
+  }
+  return NULL;
+}
+
+// Find every regular file in dir with a name matching pattern, up to as many
+// as h has inodes. Returns the number of files found, or -1 if one of them
+// can't be added with its name.
+static int list_putdir_files(mfs_t *h, DIR *dir, char *pattern, putdir_file **files) {
+  *files = NULL;
+  int num_files = 0;
+  int status = 0;
+  struct dirent *entry;
+  while(status == 0 && (entry = readdir(dir)) != NULL) {
+    struct stat buf;
+    if(fnmatch(pattern, entry->d_name, FNM_PERIOD) != 0 ||
+        fstatat(dirfd(dir), entry->d_name, &buf, 0) == -1 || !S_ISREG(buf.st_mode))
+      continue;
+    
+    if(strnlen(entry->d_name, MAX_FILENAME+1) > MAX_FILENAME) {
+      printf("putdir error: File name too long: \"%s\"\n", entry->d_name);
+      status = -1;
+    } else if(!valid_filename(entry->d_name)) {
+      printf("putdir error: Filename contains invalid characters: \"%s\"\n", entry->d_name);
+      status = -1;
+    } else if(num_files == h->max_files) {
+      printf("putdir error: Maximum amount of files has been reached (%d)\n", h->max_files);
+      status = -1;
+    } else {
+      if(num_files == 0)
+        *files = malloc(h->max_files * sizeof(putdir_file));
+      putdir_file *f = &(*files)[num_files++];
+      strcpy(f->name, entry->d_name);
+      f->size = buf.st_size;
+      f->reserved = false;
+      f->inode_idx = -1;
+      f->status = -1;
+      f->error = 0;
+    }
+  }
+  return status == 0 ? num_files : -1;
+}
+
+// Give back the dir entries taken for the files of job. The caller must
+// hold dir_lock, and dedup_lock in dedup mode.
+static void release_putdir_entries(putdir_job *job) {
+  for(int i = 0; i < job->num_files; i++) {
+    if(job->files[i].reserved)
+      release_entry(job->h, job->dest_idx, job->files[i].name);
+    job->files[i].reserved = false;
+  }
+}
+
+// Take a dir entry in the directory at dest_name, or the root directory if
+// it is NULL, for every file of job. Returns -1 and takes none if any of
+// them can't be added.
+static int reserve_putdir_entries(putdir_job *job, char *dest_name) {
+  mfs_t *h = job->h;
+  
+  pthread_rwlock_wrlock(&h->dir_lock);
+  job->dest_idx = lookup_dir(h, "putdir", dest_name);
+  int status = job->dest_idx == -1 ? -1 : 0;
+  lock_dedup(h);
+  for(int i = 0; i < job->num_files && status == 0; i++) {
+    putdir_file *f = &job->files[i];
+    status = reserve_entry(h, job->dest_idx, f->name);
+    if(status == -1)
+      print_entry_error("putdir", f->name);
+    else
+      f->reserved = true;
+  }
+  
+  if(status == -1 && job->dest_idx != -1)
+    release_putdir_entries(job);
+  unlock_dedup(h);
+  pthread_rwlock_unlock(&h->dir_lock);
+  return status;
+}
+
+// Allocate an inode and blocks for every file of job before any of them is
+// read. Returns -1 and allocates nothing if they don't all fit.
+static int alloc_putdir_files(putdir_job *job) {
+  mfs_t *h = job->h;
+  
+  off_t total_blocks = 0;
+  int status = 0;
+  for(int i = 0; i < job->num_files; i++) {
+    if(!fits_inline(job->files[i].size))
+      total_blocks += (job->files[i].size + h->block_size - 1) / h->block_size;
+  }
+  
+  // In dedup and compress mode the files may need fewer blocks, which is
+  // only known once they have been read
+  lock_dedup(h);
+  if(!blocks_taken_on_read(h) && total_blocks > __atomic_load_n(&h->free_block_count, __ATOMIC_RELAXED)) {
+    printf("putdir error: Not enough disk space\n");
+    status = -1;
+  } else if(job->num_files > __atomic_load_n(&h->free_inode_count, __ATOMIC_RELAXED)) {
+    printf("putdir error: Maximum amount of inodes has been reached (%d)\n", h->max_files);
+    status = -1;
+  } else {
+    // Other files can take inodes and blocks at the same time, so
+    // either can still run out
+    for(int i = 0; i < job->num_files && status == 0; i++) {
+      putdir_file *f = &job->files[i];
+      f->inode_idx = take_inode(h);
+      if(f->inode_idx == -1) {
+        printf("putdir error: Maximum amount of inodes has been reached (%d)\n", h->max_files);
+        status = -1;
+        break;
+      }
+      
+      status = alloc_file_blocks(h, f->inode_idx, f->size);
+      if(status == -1 && errno == EFBIG)
+        printf("putdir error: File is too large for its extent tree: \"%s\"\n", f->name);
+      else if(status == -1)
+        printf("putdir error: Not enough disk space\n");
+    }
+    
+    // Give back the files taken so far if they didn't all fit
+    for(int i = 0; i < job->num_files && status == -1 && job->files[i].inode_idx != -1; i++)
+      release_file(h, job->files[i].inode_idx);
+  }
+  unlock_dedup(h);
+  return status;
+}
+
+// Put every regular file in the directory dir_name with a name matching
+// pattern into the directory dest_name of the filesystem, or the root
+// directory if it is NULL. The files are read in by a pool of worker
+// threads, and are only added to the directory once all of them have been
+// read, so either every file is added or none are. Returns the number of
+// bytes put, or -1 if the files could not be put.
+static long put_dir(mfs_t *h, char *dir_name, char *pattern, char *dest_name) {
+  DIR *dir = opendir(dir_name);
+  if(dir == NULL) {
+    printf("putdir error: Could not open directory \"%s\": ", dir_name);
+    fflush(stdout);
+    perror("");
+    return -1;
+  }
+  
+  putdir_job job = { .h = h, .dir_fd = dirfd(dir) };
+  job.num_files = list_putdir_files(h, dir, pattern ? pattern : "*", &job.files);
+  if(job.num_files <= 0) {
+    if(job.num_files == 0)
+      printf("putdir error: No files in \"%s\" to put\n", dir_name);
+    free(job.files);
+    closedir(dir);
+    return -1;
+  }
+  
+  pthread_rwlock_rdlock(&h->image_lock);
+  
+  long total_bytes = 0;
+  for(int i = 0; i < job.num_files; i++)
+    total_bytes += job.files[i].size;
+  
+  int status = reserve_putdir_entries(&job, dest_name);
+  if(status == 0) {
+    status = alloc_putdir_files(&job);
+    if(status == -1) {
+      pthread_rwlock_wrlock(&h->dir_lock);
+      lock_dedup(h);
+      release_putdir_entries(&job);
+      unlock_dedup(h);
+      pthread_rwlock_unlock(&h->dir_lock);
+    }
+  }
+  
+  if(status == 0) {
+    printf("Reading %ld bytes from %d files in %s\n", total_bytes, job.num_files, dir_name);
+    
+    run_workers(putdir_worker, &job, job.num_files);
+    
+    for(int i = 0; i < job.num_files; i++) {
+      if(job.files[i].status == -1 && job.files[i].error == ENOSPC) {
+        printf("putdir error: Not enough disk space for \"%s\"\n", job.files[i].name);
+        status = -1;
+      } else if(job.files[i].status == -1 && job.files[i].error == EFBIG) {
+        printf("putdir error: File is too large for its extent tree: \"%s\"\n", job.files[i].name);
+        status = -1;
+      } else if(job.files[i].status == -1) {
+        printf("putdir error: An error occured reading from \"%s\"\n", job.files[i].name);
+        status = -1;
+      }
+    }
+    
+    // Add every file to the directory at once, or give everything back
+    if(status == -1) {
+      for(int i = 0; i < job.num_files; i++)
+        free_file(h, job.files[i].inode_idx);
+    }
+    pthread_rwlock_wrlock(&h->dir_lock);
+    lock_dedup(h);
+    if(status == 0) {
+      for(int i = 0; i < job.num_files; i++)
+        commit_entry(h, job.dest_idx, job.files[i].name, job.files[i].inode_idx);
+    } else {
+      release_putdir_entries(&job);
+    }
+    unlock_dedup(h);
+    pthread_rwlock_unlock(&h->dir_lock);
+  }
+  
+  pthread_rwlock_unlock(&h->image_lock);
+  free(job.files);
+  closedir(dir);
+  return status == 0 ? total_bytes : -1;
+}
+
+int mfs_putdir(mfs_t *h, char *dir_name, char *pattern, char *dest_name) {
+  uint64_t start = stats_start();
+  long bytes = put_dir(h, dir_name, pattern, dest_name);
+  stats_record(STATS_PUTDIR, start, bytes == -1 ? -1 : 0, bytes == -1 ? 0 : bytes);
+  return bytes == -1 ? -1 : 0;
+}
+
+// Fill iov with one buffer for each extent of node, which together hold the
+// data of the file. The last extent is cut short at the end of the file,
+// otherwise we'd end up with gibberish at the end of our file. An inline file
+// takes a single buffer pointing into its inode. Returns the number of
+// buffers used, which is at most node->num_extents, or 1 if it is inline.
+static int file_iov(mfs_t *h, inode *node, struct iovec *iov) {
+  if(node->flags & INODE_INLINE) {
+    iov[0].iov_base = inline_data(node);
+    iov[0].iov_len  = node->bytes;
+    return 1;
+  }
+  
+  uint64_t copy_size = node->bytes;
+  int num_iov = 0;
+  extent_walk w;
+  start_walk(&w, h, node, false);
+  for(extent *e; copy_size > 0 && (e = next_extent(&w)) != NULL; ) {
+    size_t num_bytes = (size_t) e->length * h->block_size;
+    if(copy_size < num_bytes)
+      num_bytes = copy_size;
+    
+    iov[num_iov].iov_base = block_at(h, e->start);
+    iov[num_iov].iov_len  = num_bytes;
+    num_iov++;
+    copy_size -= num_bytes;
+  }
+  return num_iov;
+}
+
+// A position in the blocks of a file, for reading them back a piece at a time
+typedef struct {
+  mfs_t *h;
+  extent_walk walk;                   // Walk through the extents of the file
+  extent *extent;                     // The extent holding the next byte, or NULL
+  size_t offset;                      // Offset of the next byte in the extent
+} file_cursor;
+
+// Start cursor c at the first byte of the file node
+static void start_cursor(file_cursor *c, mfs_t *h, inode *node) {
+  c->h = h;
+  start_walk(&c->walk, h, node, false);
+  c->extent = next_extent(&c->walk);
+  c->offset = 0;
+}
+
+// Copy the next len bytes of the blocks of the file of c into buf.
+// Returns -1 with errno set to EIO if the file ends first.
+static int read_cursor(file_cursor *c, void *buf, int len) {
+  uint8_t *p = buf;
+  while(len > 0) {
+    if(c->extent == NULL) {
+      errno = EIO;
+      return -1;
+    }
+    
+    extent *e = c->extent;
+    size_t extent_bytes = (size_t) e->length * c->h->block_size;
+    int n = extent_bytes - c->offset < (size_t) len ? (int) (extent_bytes - c->offset) : len;
+    memcpy(p, block_at(c->h, e->start) + c->offset, n);
+    p         += n;
+    len       -= n;
+    c->offset += n;
+    if(c->offset == extent_bytes) {
+      c->extent = next_extent(&c->walk);
+      c->offset = 0;
+    }
+  }
+  return 0;
+}
+
+// Write the data of the compressed file with inode node to ofd starting at
+// offset, or at the current position of ofd if offset is -1. The file is
+// decompressed one chunk at a time, so only a single chunk of it is ever
+// held in memory. Returns -1 with errno set to EIO if the file is corrupt.
+static int write_packed_file(mfs_t *h, inode *node, int ofd, off_t offset) {
+  file_cursor c;
+  start_cursor(&c, h, node);
+  uint8_t *packed = malloc(COMPRESS_CHUNK_SIZE);
+  uint8_t *chunk = malloc(COMPRESS_CHUNK_SIZE);
+  
+  int status = 0;
+  for(uint64_t done = 0; done < node->bytes && status == 0; done += COMPRESS_CHUNK_SIZE) {
+    int len = node->bytes - done < COMPRESS_CHUNK_SIZE ? node->bytes - done : COMPRESS_CHUNK_SIZE;
+    
+    uint32_t header;
+    status = read_cursor(&c, &header, sizeof(header));
+    int packed_len = header & ~CHUNK_RAW;
+    if(status == 0 && packed_len > COMPRESS_CHUNK_SIZE) {
+      errno = EIO;
+      status = -1;
+    }
+    if(status == 0)
+      status = read_cursor(&c, packed, packed_len);
+    
+    struct iovec iov = { packed, len };
+    if(status == 0 && !(header & CHUNK_RAW)) {
+      iov.iov_base = chunk;
+      if(lz_decompress(packed, packed_len, chunk, len) != len) {
+        errno = EIO;
+        status = -1;
+      }
+    } else if(status == 0 && packed_len != len) {
+      errno = EIO;
+      status = -1;
+    }
+    
+    if(status == 0)
+      status = writev_all(ofd, &iov, 1, offset);
+    if(offset != -1)
+      offset += len;
+  }
+  
+  free(packed);
+  free(chunk);
+  return status;
+}
+
+// Write the data of the file with inode node to the start of ofd
+static int write_file(mfs_t *h, inode *node, int ofd) {
+  if(node->packed_bytes > 0)
+    return write_packed_file(h, node, ofd, 0);
+  if(node->flags & INODE_INLINE)
+    return write_all(ofd, inline_data(node), node->bytes, 0);
+  
+  struct iovec *iov = malloc(node->num_extents * sizeof(struct iovec));
+  int num_iov = file_iov(h, node, iov);
+  
+  // A mapped image can have each extent copied from the image file by the
+  // kernel, otherwise write all of the extents with as few calls as we can
+  int status = 0;
+  if(h->image_fd != -1) {
+    off_t offset = 0;
+    for(int i = 0; i < num_iov && status == 0; i++) {
+      int block = block_index_of(h, iov[i].iov_base);
+      status = write_from_blocks(h, ofd, offset, block, iov[i].iov_len);
+      offset += iov[i].iov_len;
+    }
+  } else {
+    status = writev_all(ofd, iov, num_iov, 0);
+  }
+  free(iov);
+  return status;
+}
+
+// Write the data of the file with inode inode_idx to a new file on
+// the system with name newfilename
+static int get_file(mfs_t *h, int inode_idx, char *newfilename) {
+  inode *node = h->inodes[inode_idx];
+  int bad_block = verify_file(h, node);
+  if(bad_block != -1) {
+    printf("get error: Block %d of the file does not match its checksum\n", bad_block);
+    return -1;
+  }
+  
+  // Now, open the output file that we are going to write the data to.
+  int ofd = open(newfilename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if(ofd == -1) {
+    printf("get error: Could not open file \"%s\": ", newfilename);
+    fflush(stdout);
+    perror("");
+    return -1;
+  }
+
+  printf("Writing %ld bytes to %s\n", (long) node->bytes, newfilename);
+
+  int status = write_file(h, node, ofd);
+  if(status == -1) {
+    printf("get error: Could not write file \"%s\": ", newfilename);
+    fflush(stdout);
+    perror("");
+  }
+
+  // Close the output file, we're done. 
+  close(ofd);
+  return status;
+}
+
+// Get a file on the filesystem and move in onto the system. The inode
+// of the file stays locked while its data is copied out, so that it can't
+// be deleted and have its blocks reused in the meantime.
+int mfs_get(mfs_t *h, char *filename, char *newfilename) {
+  uint64_t start = stats_start();
+  pthread_rwlock_rdlock(&h->image_lock);
+  pthread_rwlock_rdlock(&h->dir_lock);
+  
+  // Search for file with filename that is valid (not deleted)
+  int inode_idx = -1;
+  dir_entry *entry = lookup_entry(h, filename, NULL);
+  if(entry == NULL) {
+    print_path_error("get", filename);
+  } else if(h->inodes[entry->inode]->flags & INODE_DIR) {
+    printf("get error: \"%s\" is a directory\n", filename);
+  } else {
+    inode_idx = entry->inode;
+    pthread_rwlock_rdlock(&h->inode_locks[inode_idx]);
+  }
+  pthread_rwlock_unlock(&h->dir_lock);
+  
+  int status = -1;
+  uint64_t bytes = 0;
+  if(inode_idx != -1) {
+    status = get_file(h, inode_idx, newfilename);
+    if(status == 0)
+      bytes = h->inodes[inode_idx]->bytes;
+    pthread_rwlock_unlock(&h->inode_locks[inode_idx]);
+  }
+  
+  pthread_rwlock_unlock(&h->image_lock);
+  stats_record(STATS_GET, start, status, bytes);
+  return status;
+}
+
+// A file or directory found by list_tree, as it was when it was listed
+typedef struct {
+  char *path;                         // Path of the file from the root directory
+  int inode;                          // The inode of the file
+  bool is_dir;                        // True if the file is a directory
+  uint64_t bytes;                     // Size of the file in bytes
+} tree_file;
+
+// Find every valid file and directory below the root directory, with each
+// directory coming before the files and directories in it. The caller must
+// hold dir_lock while they are listed, but not while they are read, so each
+// file has to be locked with lock_tree_file before it is read. Returns the
+// number of files found, which are put in a new array in *files along with
+// their paths. Both must be freed with free_tree.
+static int list_tree(mfs_t *h, tree_file **files) {
+  int num_files = 0;
+  int capacity = 16;
+  *files = malloc(capacity * sizeof(tree_file));
+  
+  // Each directory is listed once it is reached, so the files of the
+  // directories found along the way are added after them
+  for(int d = -1; d < num_files; d++) {
+    int dir_idx = d == -1 ? ROOT_INODE : (*files)[d].inode;
+    const char *dir_path = d == -1 ? NULL : (*files)[d].path;
+    if(d != -1 && !(*files)[d].is_dir)
+      continue;
+    
+    for(dir_node *leaf = first_leaf(h, h->inodes[dir_idx]); leaf != NULL; leaf = next_leaf(h, leaf)) {
+      dir_entry *entries = (dir_entry *) dir_items(leaf);
+      for(int i = 0; i < leaf->num_entries; i++) {
+        if(entries[i].state != ENTRY_VALID || entries[i].inode >= h->max_files)
+          continue;
+        if(num_files == capacity) {
+          capacity *= 2;
+          *files = realloc(*files, capacity * sizeof(tree_file));
+        }
+        
+        // dir_entry filenames are only terminated when shorter than MAX_FILENAME
+        int len = strnlen(entries[i].filename, MAX_FILENAME);
+        inode *node = h->inodes[entries[i].inode];
+        tree_file *f = &(*files)[num_files++];
+        f->inode = entries[i].inode;
+        f->is_dir = node->flags & INODE_DIR;
+        f->bytes = f->is_dir ? 0 : node->bytes;
+        f->path = malloc((dir_path ? strlen(dir_path) + 1 : 0) + len + 1);
+        sprintf(f->path, "%s%s%.*s", dir_path ? dir_path : "", dir_path ? "/" : "", len, entries[i].filename);
+      }
+    }
+  }
+  return num_files;
+}
+
+// Lock the inode of f, a file listed by list_tree, for reading before it is
+// read, and look its path up again under dir_lock, since it may have been
+// deleted or replaced since it was listed. Returns false without locking
+// anything if the path no longer leads to the same kind of file in the same
+// inode, in which case the file is skipped.
+static bool lock_tree_file(mfs_t *h, tree_file *f) {
+  pthread_rwlock_rdlock(&h->dir_lock);
+  dir_entry *entry = lookup_entry(h, f->path, NULL);
+  bool found = entry != NULL && entry->inode == f->inode &&
+      !(h->inodes[f->inode]->flags & INODE_DIR) == !f->is_dir;
+  if(found)
+    pthread_rwlock_rdlock(&h->inode_locks[f->inode]);
+  pthread_rwlock_unlock(&h->dir_lock);
+  return found;
+}
+
+// Free the files listed by list_tree
+static void free_tree(tree_file *files, int num_files) {
+  for(int i = 0; i < num_files; i++)
+    free(files[i].path);
+  free(files);
+}
+
+// Work shared by the getall worker threads
+typedef struct {
+  mfs_t *h;
+  int dir_fd;                         // The directory the files are written to
+  tree_file *files;                   // Files and directories to write
+  int num_files;
+  int next_file;                      // Index of the next file for a worker to write
+  int failed;                         // Number of files that could not be written
+} getall_job;
+
+// Write files of job into the directory until there are none left
+static void *getall_worker(void *arg) {
+  getall_job *job = arg;
+  mfs_t *h = job->h;
+  int i;
+  while((i = __atomic_fetch_add(&job->next_file, 1, __ATOMIC_RELAXED)) < job->num_files) {
+    tree_file *f = &job->files[i];
+    if(f->is_dir || !lock_tree_file(h, f))
+      continue;
+    
+    int status = -1;
+    int bad_block = verify_file(h, h->inodes[f->inode]);
+    if(bad_block != -1) {
+      printf("getall error: Block %d of \"%s\" does not match its checksum\n", bad_block, f->path);
+    } else {
+      int ofd = openat(job->dir_fd, f->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if(ofd != -1) {
+        status = write_file(h, h->inodes[f->inode], ofd);
+        close(ofd);
+      }
+      if(status == -1)
+        printf("getall error: Could not write file \"%s\"\n", f->path);
+    }
+    pthread_rwlock_unlock(&h->inode_locks[f->inode]);
+    
+    if(status == -1)
+      __atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
 
-  // If stat did return -1 then we know the input file doesn't exists or we can't use it.
-  if(status == -1) {
-    printf("open error: Failed to read file\n");
+// Get every file on the filesystem and write it into the directory
+// dir_name on the system, which is created if it doesn't exist. The
+// files are written in parallel by a pool of worker threads. Returns the
+// number of bytes written, or -1 if any file could not be written.
+static long get_all(mfs_t *h, char *dir_name) {
+  if(mkdir(dir_name, 0755) == -1 && errno != EEXIST) {
+    printf("getall error: Could not create directory \"%s\": ", dir_name);
+    fflush(stdout);
+    perror("");
     return -1;
   }
   
-  // Save off the size of the input file since we'll use it in a couple of places and 
-  // also initialize our index variables to zero. 
-  int copy_size   = buf.st_size;
-  
-  if(copy_size != NUM_BLOCKS * BLOCK_SIZE) {
-    printf("open error: Image is not correct size\n");
+  int dir_fd = open(dir_name, O_RDONLY | O_DIRECTORY);
+  if(dir_fd == -1) {
+    printf("getall error: Could not open directory \"%s\": ", dir_name);
+    fflush(stdout);
+    perror("");
     return -1;
   }
   
-  // Open the input file read-only 
-  FILE *ofp = fopen(filename, "r"); 
-  printf("Reading %d bytes from %s\n", copy_size, filename);
-
-  disk_image_name = strndup(filename, MAX_FILENAME+1);
+  // The directories are only locked while the files are listed, and each
+  // file only while it is written, so that other files can be put and
+  // deleted in the meantime. A file deleted before it is reached is left out.
+  pthread_rwlock_rdlock(&h->image_lock);
+  pthread_rwlock_rdlock(&h->dir_lock);
+  getall_job job = { .h = h, .dir_fd = dir_fd };
+  job.num_files = list_tree(h, &job.files);
+  pthread_rwlock_unlock(&h->dir_lock);
   
-  // Setup dir_entries by making each dir entry point to a spot
-  // within the first block right after the previous dir entry.
-  // Also setup each inode to point to a block after the 5th block.
-  // Each inode gets their own block
-  size_t size = sizeof(dir_entry);
-  for(int i = 0; i < MAX_FILES; i++) {
-    dir_entries[i] = (dir_entry *) &filesystem[0][size * i];
-    inodes[i] = (inode *) filesystem[i+5];
+  // Create the directories first, which come before the files in them
+  long total_bytes = 0;
+  int num_regular = 0;
+  for(int i = 0; i < job.num_files; i++) {
+    tree_file *f = &job.files[i];
+    if(!f->is_dir) {
+      total_bytes += f->bytes;
+      num_regular++;
+      continue;
+    }
+    if(mkdirat(dir_fd, f->path, 0755) == -1 && errno != EEXIST) {
+      printf("getall error: Could not create directory \"%s\": ", f->path);
+      fflush(stdout);
+      perror("");
+      job.failed++;
+    }
   }
+  printf("Writing %ld bytes from %d files to %s\n", total_bytes, num_regular, dir_name);
   
-  // Setup free_inode_map and free_block_map by making them point
-  // to the correct blocks within the filesystem (blocks 2 and 3)
-  free_inode_map = filesystem[2];
-  free_block_map = filesystem[3];
-  
-  opened = true;
-
-  // We want to copy and write in chunks of BLOCK_SIZE. So to do this 
-  // we are going to use fseek to move along our file stream in chunks of BLOCK_SIZE.
-  // We will copy bytes, increment our file pointer by BLOCK_SIZE and repeat.
-  int offset      = 0;               
-
-  // We are going to copy and store our file in BLOCK_SIZE chunks instead of one big 
-  // memory pool. Why? We are simulating the way the file system stores file data in
-  // blocks of space on the disk. block_index will keep us pointing to the area of
-  // the area that we will read from or write to.
-  int block_index = 0;
+  run_workers(getall_worker, &job, num_regular);
   
-  // copy_size is initialized to the size of the input file so each loop iteration we
-  // will copy BLOCK_SIZE bytes from the file then reduce our copy_size counter by
-  // BLOCK_SIZE number of bytes. When copy_size is less than or equal to zero we know
-  // we have copied all the data from the input file.
-  while(copy_size > 0) {
-
-    // Index into the input file by offset number of bytes.  Initially offset is set to
-    // zero so we copy BLOCK_SIZE number of bytes from the front of the file.  We 
-    // then increase the offset by BLOCK_SIZE and continue the process.  This will
-    // make us copy from offsets 0, BLOCK_SIZE, 2*BLOCK_SIZE, 3*BLOCK_SIZE, etc.
-    fseek(ofp, offset, SEEK_SET);
-
-    // Read BLOCK_SIZE number of bytes from the input file and store them in our
-    // data array. 
-    int bytes  = fread(filesystem[block_index], BLOCK_SIZE, 1, ofp);
-
-    // If bytes == 0 and we haven't reached the end of the file then something is 
-    // wrong. If 0 is returned and we also have the EOF flag set then that is OK.
-    // It means we've reached the end of our input file.
-    if(bytes == 0 && !feof(ofp)) {
-      printf("open error: An error occured reading from the input file\n");
-      fclose(ofp);
-      return -1;
-    }
+  pthread_rwlock_unlock(&h->image_lock);
+  free_tree(job.files, job.num_files);
+  close(dir_fd);
+  return job.failed == 0 ? total_bytes : -1;
+}
 
-    // Clear the EOF file flag.
-    clearerr(ofp);
+int mfs_getall(mfs_t *h, char *dir_name) {
+  uint64_t start = stats_start();
+  long bytes = get_all(h, dir_name);
+  stats_record(STATS_GETALL, start, bytes == -1 ? -1 : 0, bytes == -1 ? 0 : bytes);
+  return bytes == -1 ? -1 : 0;
+}
 
-    // Reduce copy_size by the BLOCK_SIZE bytes.
-    copy_size -= BLOCK_SIZE;
-    
-    // Increase the offset into our input file by BLOCK_SIZE.  This will allow
-    // the fseek at the top of the loop to position us to the correct spot.
-    offset    += BLOCK_SIZE;
+// Write the value into a tar header field of size bytes, as an octal
+// number padded with zeros and terminated with a NUL
+static void tar_octal(char *field, int size, unsigned long value) {
+  snprintf(field, size, "%0*lo", size - 1, value);
+}
 
-    // Increment the index into the block array 
-    block_index++;
+// Write the size of a file into the 12 byte size field of a tar header. Sizes
+// of 8GB and up don't fit in octal, so they are written the way GNU tar does,
+// as a big endian binary number with the high bit of the first byte set.
+static void tar_size(uint8_t *field, uint64_t size) {
+  if(size < (UINT64_C(1) << 33)) {
+    tar_octal((char *) field, 12, size);
+    return;
   }
-
-  // We are done copying from the input file so close it out.
-  fclose(ofp);
-
   
-  return 0;
+  memset(field, 0, 12);
+  field[0] = 0x80;
+  for(int i = 11; i >= 4; i--, size >>= 8)
+    field[i] = size & 0xff;
 }
 
-// Close the currently opened filesystem
-int fs_close() {
-  if(!opened)
-    return -1;
+// Fill header with the ustar header of the file or directory at path with
+// inode node. A path longer than the 100 characters of the name field is
+// split at a '/' into the 155 character prefix field and the name field.
+// Returns -1 if there is no such split.
+static int tar_header(uint8_t *header, char *path, inode *node) {
+  bool is_dir = node->flags & INODE_DIR;
+  size_t len = strlen(path) + is_dir;
+  size_t split = 0;
+  if(len > 100) {
+    size_t slash = len - 101;
+    while(slash <= 155 && path[slash] != '/' && path[slash] != 0)
+      slash++;
+    if(slash > 155 || path[slash] != '/')
+      return -1;
+    split = slash + 1;
+  }
   
-  free(disk_image_name);
-  opened = false;
+  memset(header, 0, TAR_BLOCK_SIZE);
+  memcpy(header + 345, path, split ? split - 1 : 0);
+  memcpy(header, path + split, len - split - is_dir);
+  if(is_dir)
+    header[len - split - 1] = '/';
+  tar_octal((char *) header + 100, 8, is_dir ? 0755 : node->attrib & R ? 0444 : 0644);
+  tar_octal((char *) header + 108, 8, 0);
+  tar_octal((char *) header + 116, 8, 0);
+  tar_size(header + 124, is_dir ? 0 : node->bytes);
+  tar_octal((char *) header + 136, 12, node->time_added);
+  header[156] = is_dir ? '5' : '0';
+  memcpy(header + 257, "ustar", 6);
+  memcpy(header + 263, "00", 2);
   
+  // The checksum is taken with the checksum field itself set to spaces
+  memset(header + 148, ' ', 8);
+  unsigned long checksum = 0;
+  for(int i = 0; i < TAR_BLOCK_SIZE; i++)
+    checksum += header[i];
+  snprintf((char *) header + 148, 8, "%06lo", checksum);
   return 0;
 }
 
-// List all files not marked as deleted. Only show hidden files
-// if show_hidden is true
-int fs_list(bool show_hidden) {
-  if(!opened) {
-    printf("list error: No file system is currently open\n");
-    return -1;
-  }
+// Get every file on the filesystem and write them to fd as a tar archive.
+// The data of each file is written straight from its blocks, along with
+// its header and padding, with a single vectored write. Compressed files
+// are decompressed into the archive between their header and padding.
+int mfs_getall_tar(mfs_t *h, int fd) {
+  static const uint8_t zeros[2 * TAR_BLOCK_SIZE];
+  uint64_t start = stats_start();
+  uint64_t bytes = 0;
   
-  for(int i = 0; i < MAX_FILES; i++) {
-    int inode_idx = dir_entries[i]->inode;
+  // The directories are only locked while the files are listed, and each
+  // file only while it is written to the archive. A file deleted before it
+  // is reached is left out.
+  pthread_rwlock_rdlock(&h->image_lock);
+  pthread_rwlock_rdlock(&h->dir_lock);
+  tree_file *files;
+  int num_files = list_tree(h, &files);
+  pthread_rwlock_unlock(&h->dir_lock);
+  
+  // Each file takes a buffer for each of its extents, or one if it is
+  // inline or a directory, plus its header and padding
+  uint8_t header[TAR_BLOCK_SIZE];
+  uint32_t max_extents = 1;
+  struct iovec *iov = malloc((max_extents + 2) * sizeof(struct iovec));
+  int status = 0;
+  for(int i = 0; i < num_files && status == 0; i++) {
+    tree_file *f = &files[i];
+    if(!lock_tree_file(h, f))
+      continue;
+    
+    inode *node = h->inodes[f->inode];
+    bool is_dir = f->is_dir;
+    if(!is_dir && node->num_extents > max_extents) {
+      max_extents = node->num_extents;
+      iov = realloc(iov, (max_extents + 2) * sizeof(struct iovec));
+    }
+    int bad_block = is_dir ? -1 : verify_file(h, node);
+    if(bad_block != -1) {
+      printf("getall error: Block %d of \"%s\" does not match its checksum\n", bad_block, f->path);
+      errno = EIO;
+      status = -1;
+    } else if(tar_header(header, f->path, node) == -1) {
+      printf("getall error: Path is too long for a tar archive: \"%s\"\n", f->path);
+      errno = ENAMETOOLONG;
+      status = -1;
+    }
+    if(status == -1) {
+      pthread_rwlock_unlock(&h->inode_locks[f->inode]);
+      break;
+    }
     
-    // Check that the current file is not deleted and it is not hidden, unless we are
-    // meant to show hidden files
-    if(dir_entries[i]->valid && (!(inodes[inode_idx]->attrib & H) || show_hidden)) {
-      char *time_str = ctime(&inodes[inode_idx]->time_added);
-      time_str[strlen(time_str)-1] = 0; // Remove newline character from string
-      printf("%8d %s %s\n", inodes[inode_idx]->bytes, time_str, dir_entries[i]->filename);
+    // The data is padded out to a whole number of tar blocks. A directory
+    // is only its header.
+    iov[0].iov_base = header;
+    iov[0].iov_len  = TAR_BLOCK_SIZE;
+    int num_iov = 1;
+    uint64_t size = is_dir ? 0 : node->bytes;
+    if(!is_dir && node->packed_bytes > 0) {
+      status = writev_all(fd, iov, 1, -1);
+      if(status == 0)
+        status = write_packed_file(h, node, fd, -1);
+      num_iov = 0;
+    } else if(!is_dir) {
+      num_iov += file_iov(h, node, iov + 1);
     }
+    iov[num_iov].iov_base = (void *) zeros;
+    iov[num_iov].iov_len  = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+    num_iov++;
+    
+    if(status == 0)
+      status = writev_all(fd, iov, num_iov, -1);
+    bytes += size;
+    pthread_rwlock_unlock(&h->inode_locks[f->inode]);
   }
+  free(iov);
+  free_tree(files, num_files);
+  pthread_rwlock_unlock(&h->image_lock);
   
-  return 0;
+  // The archive ends with two blocks of zeros
+  if(status == 0) {
+    struct iovec end = { (void *) zeros, sizeof(zeros) };
+    status = writev_all(fd, &end, 1, -1);
+  }
+  
+  if(status == -1) {
+    printf("getall error: Could not write archive: ");
+    fflush(stdout);
+    perror("");
+  }
+  stats_record(STATS_GETALL, start, status, status == 0 ? bytes : 0);
+  return status;
 }
 
-// Put a file currently on the system into the filesystem
-int fs_put(char *filename) {
-  if(!opened) {
-    printf("put error: No file system is currently open\n");
-    return -1;
-  }
+int mfs_del(mfs_t *h, char *filename) {
+  uint64_t start = stats_start();
+  pthread_rwlock_rdlock(&h->image_lock);
+  pthread_rwlock_wrlock(&h->dir_lock);
   
-  // Make sure filename is not too long
-  if(strnlen(filename, MAX_FILENAME+1) > MAX_FILENAME) {
-    printf("put error: File name too long\n");
-    return -1;
+  // Search for file with filename that is valid (not deleted)
+  int status = -1;
+  int dir_idx;
+  int inode_idx = -1;
+  dir_entry *entry = lookup_entry(h, filename, &dir_idx);
+  if(entry == NULL) {
+    print_path_error("del", filename);
+  } else if(h->inodes[entry->inode]->flags & INODE_DIR) {
+    printf("del error: Cannot delete a directory, use rmdir instead\n");
+  } else if(h->inodes[entry->inode]->attrib & R) {
+    printf("del error: Cannot delete read-only file\n");
+  } else {
+    // The entry keeps its inode so that the file can be brought back. Once
+    // it is marked as deleted, no get can find the file any longer.
+    inode_idx = entry->inode;
+    inode *dir = h->inodes[dir_idx];
+    set_entry_state(h, dir, entry, ENTRY_DELETED);
+    if(dir_header_of(dir)->deleted_entries > MAX_DELETED_ENTRIES) {
+      lock_dedup(h);
+      prune_deleted_entries(h, dir, inode_idx);
+      unlock_dedup(h);
+    }
+    status = 0;
   }
+  pthread_rwlock_unlock(&h->dir_lock);
   
-  if(!valid_filename(filename)) {
-    printf("put error: Filename contains invalid characters\n");
-    return -1;
+  // Wait for every get of the file to finish before its blocks are freed.
+  // The directories aren't locked meanwhile, so a slow get only holds up
+  // the del.
+  if(inode_idx != -1) {
+    pthread_rwlock_wrlock(&h->inode_locks[inode_idx]);
+    free_file(h, inode_idx);
+    pthread_rwlock_unlock(&h->inode_locks[inode_idx]);
   }
+  pthread_rwlock_unlock(&h->image_lock);
+  stats_record(STATS_DEL, start, status, 0);
+  return status;
+}
+
+// Return true if the deleted file with inode inode_idx can't be brought back,
+// because its inode or any of its blocks have been given to another file
+// since it was deleted. The caller must hold the lock of every group.
+static bool file_overwritten(mfs_t *h, int inode_idx) {
+  // Directories are never deleted, only removed, so a directory in the
+  // inode was made after the file was deleted
+  if(!inode_free(h, inode_idx) || (h->inodes[inode_idx]->flags & INODE_DIR))
+    return true;
   
-  // Check if another file with the same name exists (only checks undeleted files)
-  int valid_idx = find_dir_entry(filename, true);
-  if(valid_idx != -1) {
-    printf("put error: Another file with the same name already exists\n");
-    return -1;
+  // Outside of dedup mode no other file can share any of the blocks. The
+  // blocks of the extent tree are never shared, and a tree that no longer
+  // walks has been written over.
+  inode *node = h->inodes[inode_idx];
+  extent_walk w;
+  start_walk(&w, h, node, true);
+  for(extent *e; (e = next_extent(&w)) != NULL; ) {
+    for(int j = e->start; j < e->start + e->length && (!h->dedup || tree_extent(&w, e)); j++) {
+      if(h->block_refs[j] > 0)
+        return true;
+    }
   }
+  if(w.failed_block != -1)
+    return true;
   
-  int    status;                   // Hold the status of all return values.
-  struct stat buf;                 // stat struct to hold the returns from the stat call
-
-  // Call stat with out input filename to verify that the file exists.  It will also 
-  // allow us to get the file size. We also get interesting file system info about the
-  // file such as inode number, block size, and number of blocks.  For now, we don't 
-  // care about anything but the filesize.
-  status =  stat(filename, &buf); 
+  // A block that was taken and then freed again holds other data, and has a
+  // checksum that doesn't match the one kept for the file
+  return verify_file(h, node) != -1 || file_checksum(h, node) != node->checksum;
+}
 
-  // If stat did return -1 then we know the input file doesn't exists or we can't use it.
-  if(status == -1) {
-    printf("put error: Failed to read file\n");
-    return -1;
+int mfs_undel(mfs_t *h, char *filename) {
+  uint64_t start = stats_start();
+  pthread_rwlock_rdlock(&h->image_lock);
+  pthread_rwlock_wrlock(&h->dir_lock);
+  
+  // Search for file with filename that is marked deleted. A directory has
+  // a single entry for each name, so an entry taken by a put that is still
+  // running, or by a file added since, is in use.
+  int status = -1;
+  char name[MAX_FILENAME+1];
+  int dir_idx = lookup_parent(h, filename, name);
+  dir_entry *entry = dir_idx == -1 ? NULL : find_entry(h, h->inodes[dir_idx], name);
+  if(dir_idx == -1 && errno != ENOENT) {
+    print_path_error("undel", filename);
+  } else if(entry == NULL || entry->inode >= h->max_files) {
+    printf("undel error: Unable to find file \"%s\"\n", filename);
+  } else if(entry->state != ENTRY_DELETED) {
+    printf("undel error: Another file with the same name already exists\n");
+  } else {
+    // Mark the inode and all blocks corresponding to inode as no longer free,
+    // unless another file has taken any of them since the file was deleted.
+    // The blocks can be in any group, so every group stays locked until
+    // they have all been taken back. The inode doesn't need locking, since
+    // a del only gives it back once it is done with it and gets can't find
+    // a deleted file.
+    int inode_idx = entry->inode;
+    lock_dedup(h);
+    for(int i = 0; i < h->num_groups; i++)
+      pthread_mutex_lock(&h->groups[i].lock);
+    if(file_overwritten(h, inode_idx)) {
+      printf("undel error: File has been overwritten\n");
+    } else {
+      set_inode_free(h, inode_idx, false);
+      ref_file(h, h->inodes[inode_idx]);
+      status = 0;
+    }
+    for(int i = h->num_groups - 1; i >= 0; i--)
+      pthread_mutex_unlock(&h->groups[i].lock);
+    unlock_dedup(h);
+    
+    if(status == 0)
+      set_entry_state(h, h->inodes[dir_idx], entry, ENTRY_VALID);
   }
   
-  // Save off the size of the input file since we'll use it in a couple of places and 
-  // also initialize our index variables to zero. 
-  int copy_size   = buf.st_size;
+  pthread_rwlock_unlock(&h->dir_lock);
+  pthread_rwlock_unlock(&h->image_lock);
+  stats_record(STATS_UNDEL, start, status, 0);
+  return status;
+}
+
+// Make a new, empty directory at the path dir_name. A deleted file with
+// the same name is taken over, and can't be brought back after.
+int mfs_mkdir(mfs_t *h, char *dir_name) {
+  uint64_t start = stats_start();
+  pthread_rwlock_rdlock(&h->image_lock);
+  pthread_rwlock_wrlock(&h->dir_lock);
   
-  // If the size of the file is greater than the available space left,
-  // we cannot fit this file. Return failure.
-  if(copy_size > fs_df()) {
-    printf("put error: Not enough disk space\n");
-    return -1;
+  int status = -1;
+  char name[MAX_FILENAME+1];
+  int parent_idx = lookup_parent(h, dir_name, name);
+  dir_entry *entry = parent_idx == -1 ? NULL : find_entry(h, h->inodes[parent_idx], name);
+  if(parent_idx == -1) {
+    print_path_error("mkdir", dir_name);
+  } else if(entry != NULL && entry->state != ENTRY_DELETED) {
+    printf("mkdir error: Another file with the same name already exists\n");
+  } else {
+    // The directory starts out as a single empty leaf, which is its root
+    lock_dedup(h);
+    int inode_idx = take_inode(h);
+    extent e;
+    if(inode_idx == -1) {
+      printf("mkdir error: Maximum amount of inodes has been reached (%d)\n", h->max_files);
+    } else {
+      inode *node = h->inodes[inode_idx];
+      memset(node, 0, INODE_SIZE);
+      node->time_added = time(NULL);
+      mark_dirty(h, node);
+      if(alloc_extent(h, home_group(h, node), 1, &e) == 0) {
+        printf("mkdir error: Not enough disk space\n");
+      } else {
+        init_dir_node(h, e.start, 0);
+        *dir_root(node) = e.start;
+        node->flags = INODE_DIR;
+        node->used_blocks = 1;
+        node->bytes = h->block_size;
+        status = 0;
+      }
+      
+      if(status == 0 && entry != NULL) {
+        entry->inode = inode_idx;
+        set_entry_state(h, h->inodes[parent_idx], entry, ENTRY_VALID);
+      } else if(status == 0 && insert_entry(h, h->inodes[parent_idx], name, inode_idx, ENTRY_VALID) == -1) {
+        print_entry_error("mkdir", name);
+        status = -1;
+      }
+      if(status == -1)
+        release_file(h, inode_idx);
+    }
+    unlock_dedup(h);
   }
   
-  // If the size of the file is greater than the maximum file size,
-  // we cannot fit this file. Return failure.
-  if(copy_size > MAX_FILE_SIZE) {
-    printf("put error: File size is greater than maximum file size: %d\n", MAX_FILE_SIZE);
-    return -1;
-  }
+  pthread_rwlock_unlock(&h->dir_lock);
+  pthread_rwlock_unlock(&h->image_lock);
+  stats_record(STATS_MKDIR, start, status, 0);
+  return status;
+}
+
+// Remove the empty directory at the path dir_name. Unlike a deleted file,
+// a removed directory can't be brought back.
+int mfs_rmdir(mfs_t *h, char *dir_name) {
+  uint64_t start = stats_start();
+  pthread_rwlock_rdlock(&h->image_lock);
+  pthread_rwlock_wrlock(&h->dir_lock);
   
-  // Get the index of the next free dir entry and inode so we can use them
-  int dir_entry_idx = find_next_free_dir_entry();
-  if(dir_entry_idx == -1) {
-    printf("put error: Maximum amount of files has been reached (%d)\n", MAX_FILES);
-    return -1;
+  int status = -1;
+  int parent_idx;
+  int inode_idx = -1;
+  dir_entry *entry = lookup_entry(h, dir_name, &parent_idx);
+  if(entry == NULL) {
+    print_path_error("rmdir", dir_name);
+  } else if(!(h->inodes[entry->inode]->flags & INODE_DIR)) {
+    printf("rmdir error: \"%s\" is not a directory\n", dir_name);
+  } else if(h->inodes[entry->inode]->attrib & R) {
+    printf("rmdir error: Cannot delete read-only directory\n");
+  } else if(!dir_empty(h, h->inodes[entry->inode])) {
+    printf("rmdir error: Directory is not empty\n");
+  } else {
+    // Any deleted files left in the directory go with it
+    inode_idx = entry->inode;
+    lock_dedup(h);
+    remove_entry(h, h->inodes[parent_idx], entry);
+    unlock_dedup(h);
+    status = 0;
   }
+  pthread_rwlock_unlock(&h->dir_lock);
   
-  int inode_idx = find_next_free_inode();
-  if(inode_idx == -1) {
-    printf("put error: Maximum amount of inodes has been reached (%d)\n", MAX_FILES);
-    return -1;
+  // An export reading the directory has it locked, and is waited for
+  // without holding up the other directories
+  if(inode_idx != -1) {
+    pthread_rwlock_wrlock(&h->inode_locks[inode_idx]);
+    free_file(h, inode_idx);
+    pthread_rwlock_unlock(&h->inode_locks[inode_idx]);
   }
+  pthread_rwlock_unlock(&h->image_lock);
+  stats_record(STATS_RMDIR, start, status, 0);
+  return status;
+}
+
+long mfs_df(mfs_t *h) {
+  uint64_t start = stats_start();
   
-  // Clear all values in both the dir entry and inode
-  memset(dir_entries[dir_entry_idx], 0, sizeof(dir_entry));
-  memset(inodes[inode_idx], 0, sizeof(inode));
-  
-  // Set filename, inode index, and mark file as valid
-  strncpy(dir_entries[dir_entry_idx]->filename, filename, MAX_FILENAME);
-  dir_entries[dir_entry_idx]->inode = inode_idx;
-  dir_entries[dir_entry_idx]->valid = true;
-  
-  // Set file size in bytes, time added, and set attributes to none
-  inodes[inode_idx]->bytes = copy_size;
-  inodes[inode_idx]->time_added = time(NULL);
-  inodes[inode_idx]->attrib = 0;
+  // Multiply the number of free blocks by the size of 1 block
+  // to get the amount of free space
+  long free_bytes = (long) __atomic_load_n(&h->free_block_count, __ATOMIC_RELAXED) * h->block_size;
   
-  // Open the input file read-only 
-  FILE *ifp = fopen(filename, "r"); 
-  printf("Reading %d bytes from %s\n", copy_size, filename);
+  stats_record(STATS_DF, start, 0, 0);
+  return free_bytes;
+}
 
+// What scrub found in one file
+typedef struct {
+  bool checked;                       // False for directories and files deleted before they were reached
+  int num_blocks;                     // Blocks of the file, those of its extent tree included
+  int *bad_blocks;                    // Blocks that don't match their checksum
+  int num_bad;
+  int failed_block;                   // Block holding a corrupt part of the extent tree, or -1
+  bool bad_inline;                    // True if the inline data doesn't match its checksum
+} scrub_file;
 
-  // We want to copy and write in chunks of BLOCK_SIZE. So to do this 
-  // we are going to use fseek to move along our file stream in chunks of BLOCK_SIZE.
-  // We will copy bytes, increment our file pointer by BLOCK_SIZE and repeat.
-  int offset      = 0;               
+// Work shared by the scrub worker threads
+typedef struct {
+  mfs_t *h;
+  tree_file *files;
+  scrub_file *results;                // What was found in each file
+  int num_files;
+  int next_file;                      // Index of the next file for a worker to check
+} scrub_job;
 
-  // We are going to copy and store our file in BLOCK_SIZE chunks instead of one big 
-  // memory pool. Why? We are simulating the way the file system stores file data in
-  // blocks of space on the disk. block_index will keep us pointing to the area of
-  // the area that we will read from or write to.
-  int block_index = find_next_free_block();
-  
-  free_inode_map[inode_idx] = 0;
-  int direct_data_block_idx = 0;
+// Check the blocks of files of job against their checksums until there are
+// none left. Each file is locked while it is checked, so that it can't be
+// deleted and have its blocks reused in the meantime.
+static void *scrub_worker(void *arg) {
+  scrub_job *job = arg;
+  mfs_t *h = job->h;
+  int i;
+  while((i = __atomic_fetch_add(&job->next_file, 1, __ATOMIC_RELAXED)) < job->num_files) {
+    tree_file *f = &job->files[i];
+    scrub_file *r = &job->results[i];
+    if(f->is_dir || !lock_tree_file(h, f))
+      continue;
+    
+    inode *node = h->inodes[f->inode];
+    int capacity = 0;
+    extent_walk w;
+    start_walk(&w, h, node, true);
+    for(extent *e; (e = next_extent(&w)) != NULL; ) {
+      for(int k = e->start; k < e->start + e->length; k++) {
+        r->num_blocks++;
+        if(crc32c(0, block_at(h, k), h->block_size) == *checksum_of(h, k))
+          continue;
+        if(r->num_bad == capacity) {
+          capacity = capacity ? capacity * 2 : 16;
+          r->bad_blocks = realloc(r->bad_blocks, capacity * sizeof(int));
+        }
+        r->bad_blocks[r->num_bad++] = k;
+      }
+    }
+    r->failed_block = w.failed_block;
+    
+    // Inline files have no blocks, and their data is checked instead
+    r->bad_inline = (node->flags & INODE_INLINE) && verify_file(h, node) != -1;
+    r->checked = true;
+    pthread_rwlock_unlock(&h->inode_locks[f->inode]);
+  }
+  return NULL;
+}
 
-  // copy_size is initialized to the size of the input file so each loop iteration we
-  // will copy BLOCK_SIZE bytes from the file then reduce our copy_size counter by
-  // BLOCK_SIZE number of bytes. When copy_size is less than or equal to zero we know
-  // we have copied all the data from the input file.
-  while(copy_size > 0) {
+// Check every block of every file against its checksum on a pool of worker
+// threads, and report each one that doesn't match. Returns the number of
+// bad blocks found.
+int mfs_scrub(mfs_t *h) {
+  uint64_t start = stats_start();
+  
+  // The directories are only locked while the files are listed
+  pthread_rwlock_rdlock(&h->image_lock);
+  pthread_rwlock_rdlock(&h->dir_lock);
+  scrub_job job = { .h = h };
+  job.num_files = list_tree(h, &job.files);
+  pthread_rwlock_unlock(&h->dir_lock);
+  
+  job.results = calloc(job.num_files + 1, sizeof(scrub_file));
+  run_workers(scrub_worker, &job, job.num_files);
+  
+  int num_blocks = 0;
+  int num_regular = 0;
+  int num_bad = 0;
+  for(int i = 0; i < job.num_files; i++) {
+    scrub_file *r = &job.results[i];
+    char *path = job.files[i].path;
+    if(!r->checked)
+      continue;
+    
+    num_regular++;
+    num_blocks += r->num_blocks;
+    if(r->failed_block != -1) {
+      printf("Block %d of %s holds a corrupt extent tree\n", r->failed_block, path);
+      num_bad++;
+    }
+    if(r->bad_inline) {
+      printf("Inline data of %s does not match its checksum\n", path);
+      num_bad++;
+    }
+    for(int k = 0; k < r->num_bad; k++)
+      printf("Block %d of %s does not match its checksum\n", r->bad_blocks[k], path);
+    num_bad += r->num_bad;
+    free(r->bad_blocks);
+  }
+  printf("Scrubbed %d blocks of %d files, %d bad\n", num_blocks, num_regular, num_bad);
+  
+  free(job.results);
+  free_tree(job.files, job.num_files);
+  pthread_rwlock_unlock(&h->image_lock);
+  stats_record(STATS_SCRUB, start, 0, (uint64_t) num_blocks * h->block_size);
+  return num_bad;
+}
 
-    // Index into the input file by offset number of bytes.  Initially offset is set to
-    // zero so we copy BLOCK_SIZE number of bytes from the front of the file.  We 
-    // then increase the offset by BLOCK_SIZE and continue the process.  This will
-    // make us copy from offsets 0, BLOCK_SIZE, 2*BLOCK_SIZE, 3*BLOCK_SIZE, etc.
-    fseek(ifp, offset, SEEK_SET);
+// The fs_* functions below work on a single image at a time, which is kept
+// in current while it is open
 
-    // Read BLOCK_SIZE number of bytes from the input file and store them in our
-    // data array. 
-    int bytes  = fread(filesystem[block_index], BLOCK_SIZE, 1, ifp);
+int fs_createfs(char *name) {
+  return fs_createfs_flags(name, 0);
+}
 
-    // If bytes == 0 and we haven't reached the end of the file then something is 
-    // wrong. If 0 is returned and we also have the EOF flag set then that is OK.
-    // It means we've reached the end of our input file.
-    if(bytes == 0 && !feof(ifp)) {
-      printf("put error: An error occured reading from the input file\n");
-      fclose(ifp);
-      return -1;
-    }
+int fs_createfs_flags(char *name, create_flag flags) {
+  return fs_createfs_geometry(name, flags, NULL);
+}
 
-    // Clear the EOF file flag.
-    clearerr(ifp);
+int fs_createfs_geometry(char *name, create_flag flags, const mfs_geometry *geometry) {
+  return mfs_createfs(name, flags, geometry);
+}
 
-    // Reduce copy_size by the BLOCK_SIZE bytes.
-    copy_size -= BLOCK_SIZE;
-    
-    // Increase the offset into our input file by BLOCK_SIZE.  This will allow
-    // the fseek at the top of the loop to position us to the correct spot.
-    offset    += BLOCK_SIZE;
+int fs_open(char *filename) {
+  return fs_open_flags(filename, 0);
+}
 
-    free_block_map[block_index] = 0;
-    inodes[inode_idx]->blocks[direct_data_block_idx] = block_index;
-    inodes[inode_idx]->used_blocks++;
-    direct_data_block_idx++;
-    
-    // Increment the index into the block array 
-    block_index = find_next_free_block();
+int fs_open_flags(char *filename, open_flag flags) {
+  if(current) {
+    printf("open error: Another file system is already open\n");
+    return -1;
   }
-
-  // We are done copying from the input file so close it out.
-  fclose(ifp);
-  return 0;
+  
+  current = mfs_open(filename, flags);
+  return current ? 0 : -1;
 }
 
-// Get a file on the filesystem and move in onto the system
-int fs_get(char *filename, char *newfilename) {
-  if(!opened) {
-    printf("get error: No file system is currently open\n");
+int fs_close() {
+  if(!current)
     return -1;
-  }
   
-  // Search for file with filename that is valid (not deleted)
-  int dir_idx = find_dir_entry(filename, true);
-  if(dir_idx == -1 || !dir_entries[dir_idx]->valid) {
-    printf("get error: Unable to find file \"%s\"\n", filename);
+  int status = mfs_close(current);
+  current = NULL;
+  return status;
+}
+
+int fs_savefs() {
+  if(!current) {
+    printf("savefs error: No file system is currently open\n");
     return -1;
   }
-  inode_ptr inode_idx = dir_entries[dir_idx]->inode;
-  if(inode_idx >= MAX_FILES) {
-    printf("get error: File has invalid inode index\n");
+  return mfs_savefs(current);
+}
+
+int fs_setattrib(char *filename, attrib a, bool enabled) {
+  if(!current) {
+    printf("attrib error: No file system is currently open\n");
     return -1;
   }
-  
-  // Now, open the output file that we are going to write the data to.
-  FILE *ofp;
-  ofp = fopen(newfilename, "w");
+  return mfs_setattrib(current, filename, a, enabled);
+}
 
-  if(ofp == NULL) {
-    printf("get error: Could not open file \"%s\": ", disk_image_name);
-    fflush(stdout);
-    perror("");
+int fs_list(char *dir_name, bool show_hidden) {
+  if(!current) {
+    printf("list error: No file system is currently open\n");
     return -1;
   }
+  return mfs_list(current, dir_name, show_hidden);
+}
 
-  // Initialize our offsets and pointers just we did above when reading from the file.
-  block_ptr direct_block_idx = 0;
-  int copy_size   = inodes[inode_idx]->bytes;
-  int offset      = 0;
-
-  printf("Writing %d bytes to %s\n", copy_size, newfilename);
-
-  // Using copy_size as a count to determine when we've copied enough bytes to the output file.
-  // Each time through the loop, except the last time, we will copy BLOCK_SIZE number of bytes from
-  // our stored data to the file fp, then we will increment the offset into the file we are writing to.
-  // On the last iteration of the loop, instead of copying BLOCK_SIZE number of bytes we just copy
-  // how ever much is remaining ( copy_size % BLOCK_SIZE ).  If we just copied BLOCK_SIZE on the
-  // last iteration we'd end up with gibberish at the end of our file. 
-  while(copy_size > 0) {
-
-    int num_bytes;
-
-    // If the remaining number of bytes we need to copy is less than BLOCK_SIZE then
-    // only copy the amount that remains. If we copied BLOCK_SIZE number of bytes we'd
-    // end up with garbage at the end of the file.
-    if(copy_size < BLOCK_SIZE) {
-      num_bytes = copy_size;
-    } else {
-      num_bytes = BLOCK_SIZE;
-    }
+int fs_put(char *filename, char *newfilename) {
+  if(!current) {
+    printf("put error: No file system is currently open\n");
+    return -1;
+  }
+  return mfs_put(current, filename, newfilename);
+}
 
-    // Write num_bytes number of bytes from our data array into our output file.
-    uint8_t *block = filesystem[inodes[inode_idx]->blocks[direct_block_idx]];
-    fwrite(block, num_bytes, 1, ofp); 
+int fs_putdir(char *dir_name, char *pattern, char *dest_name) {
+  if(!current) {
+    printf("putdir error: No file system is currently open\n");
+    return -1;
+  }
+  return mfs_putdir(current, dir_name, pattern, dest_name);
+}
 
-    // Reduce the amount of bytes remaining to copy, increase the offset into the file
-    // and increment the block_index to move us to the next data block.
-    copy_size -= BLOCK_SIZE;
-    offset    += BLOCK_SIZE;
-    direct_block_idx++;
+int fs_get(char *filename, char *newfilename) {
+  if(!current) {
+    printf("get error: No file system is currently open\n");
+    return -1;
+  }
+  return mfs_get(current, filename, newfilename);
+}
 
-    // Since we've copied from the point pointed to by our current file pointer, increment
-    // offset number of bytes so we will be ready to copy to the next area of our output file.
-    fseek(ofp, offset, SEEK_SET);
+int fs_getall(char *dir_name) {
+  if(!current) {
+    printf("getall error: No file system is currently open\n");
+    return -1;
   }
+  return mfs_getall(current, dir_name);
+}
 
-  // Close the output file, we're done. 
-  fclose(ofp);
-  return 0;
+int fs_getall_tar(int fd) {
+  if(!current) {
+    printf("getall error: No file system is currently open\n");
+    return -1;
+  }
+  return mfs_getall_tar(current, fd);
 }
 
 int fs_del(char *filename) {
-  if(!opened) {
+  if(!current) {
     printf("del error: No file system is currently open\n");
     return -1;
   }
-  
-  // Search for file with filename that is valid (not deleted)
-  int dir_idx = find_dir_entry(filename, true);
-  if(dir_idx == -1) {
-    printf("del error: Unable to find file \"%s\"\n", filename);
+  return mfs_del(current, filename);
+}
+
+int fs_undel(char *filename) {
+  if(!current) {
+    printf("undel error: No file system is currently open\n");
     return -1;
   }
-  
-  int inode_idx = dir_entries[dir_idx]->inode;
-  if(inodes[inode_idx]->attrib & R) {
-    printf("del error: Cannot delete read-only file\n");
+  return mfs_undel(current, filename);
+}
+
+int fs_mkdir(char *dir_name) {
+  if(!current) {
+    printf("mkdir error: No file system is currently open\n");
     return -1;
   }
-  dir_entries[dir_idx]->valid = false;
-  free_inode_map[inode_idx] = 1;
-  
-  // Mark all blocks corresponding to inode as free
-  for(int i = 0; i < inodes[inode_idx]->used_blocks; i++) {
-    free_block_map[inodes[inode_idx]->blocks[i]] = 1;
-  }
-  
-  return 0;
+  return mfs_mkdir(current, dir_name);
 }
 
-int fs_undel(char *filename) {
-  if(!opened) {
-    printf("undel error: No file system is currently open\n");
+int fs_rmdir(char *dir_name) {
+  if(!current) {
+    printf("rmdir error: No file system is currently open\n");
     return -1;
   }
-  
-  // Search for file with filename that is marked invalid (deleted)
-  int dir_idx = find_dir_entry(filename, false);
-  if(dir_idx == -1) {
-    printf("undel error: Unable to find file \"%s\"\n", filename);
+  return mfs_rmdir(current, dir_name);
+}
+
+long fs_df() {
+  if(!current) {
+    printf("df error: No file system is currently open\n");
     return -1;
   }
-  
-  int inode_idx = dir_entries[dir_idx]->inode;
-  
-  // Check that inodes filename matches dir entries filename so that we know they
-  // should correspond to each other
-  dir_entries[dir_idx]->valid = true;
-  free_inode_map[inode_idx] = 0;
-  // Mark all blocks corresponding to inode as no longer free
-  for(int i = 0; i < inodes[inode_idx]->used_blocks; i++) {
-    free_block_map[inodes[inode_idx]->blocks[i]] = 0;
-  }
-  
-  return 0;
+  return mfs_df(current);
 }
 
-int fs_df() {
-  // Count number of free blocks, then multiply by size of 1 block
-  // to get the amount of free space
-  int count = 0;
-  for(int i = 0; i < NUM_BLOCKS; i++)
-    if(free_block_map[i])
-      count++;
-  return count * BLOCK_SIZE;
+int fs_scrub() {
+  if(!current) {
+    printf("scrub error: No file system is currently open\n");
+    return -1;
+  }
+  return mfs_scrub(current);
 }
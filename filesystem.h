@@ -8,26 +8,102 @@ typedef enum {
   H = 0b10,
 } attrib;
 
+typedef enum {
+  FS_MMAP = 0b01,   // Map the image file directly instead of reading it into memory
+} open_flag;
+
+typedef enum {
+  FS_PREALLOCATE = 0b01,  // Reserve disk space for every block instead of leaving a sparse file
+  FS_DEDUP       = 0b10,  // Share blocks holding the same data between files put into the image
+  FS_COMPRESS    = 0b100, // Compress files put into the image
+} create_flag;
+
+// Shape of a new image. Fields left as 0 take their default, which gives
+// 4226 blocks of 8192 bytes and 125 inodes.
+typedef struct {
+  int block_size;         // Bytes in each block, a power of two from 1024 to 65536
+  int num_blocks;         // Blocks in the image, the metadata blocks included, at most 2^30
+  int max_files;          // Number of inodes, which is the most files the image can hold
+} mfs_geometry;
+
+// An opened image. Any number of images can be open at once, each through
+// its own handle, with every mfs_* call working only on the image of h.
+typedef struct mfs mfs_t;
+
+int mfs_createfs(char *disk_image_name, create_flag flags, const mfs_geometry *geometry);
+
+mfs_t *mfs_open(char *image, open_flag flags);
+
+int mfs_close(mfs_t *h);
+
+int mfs_savefs(mfs_t *h);
+
+int mfs_setattrib(mfs_t *h, char *filename, attrib a, bool enabled);
+
+int mfs_list(mfs_t *h, char *dir_name, bool show_hidden);
+
+int mfs_put(mfs_t *h, char *filename, char *newfilename);
+
+int mfs_putdir(mfs_t *h, char *dir_name, char *pattern, char *dest_name);
+
+int mfs_get(mfs_t *h, char *filename, char *newfilename);
+
+int mfs_getall(mfs_t *h, char *dir_name);
+
+int mfs_getall_tar(mfs_t *h, int fd);
+
+int mfs_del(mfs_t *h, char *filename);
+
+int mfs_undel(mfs_t *h, char *filename);
+
+int mfs_mkdir(mfs_t *h, char *dir_name);
+
+int mfs_rmdir(mfs_t *h, char *dir_name);
+
+long mfs_df(mfs_t *h);
+
+int mfs_scrub(mfs_t *h);
+
+// The fs_* functions work on a single image that stays open between calls
+
 int fs_createfs(char *disk_image_name);
 
+int fs_createfs_flags(char *disk_image_name, create_flag flags);
+
+int fs_createfs_geometry(char *disk_image_name, create_flag flags, const mfs_geometry *geometry);
+
 int fs_savefs();
 
 int fs_setattrib(char *filename, attrib a, bool enabled);
 
 int fs_open(char *image);
 
+int fs_open_flags(char *image, open_flag flags);
+
 int fs_close();
 
-int fs_list(bool show_hidden);
+int fs_list(char *dir_name, bool show_hidden);
 
-int fs_put(char *filename);
+int fs_put(char *filename, char *newfilename);
+
+int fs_putdir(char *dir_name, char *pattern, char *dest_name);
 
 int fs_get(char *filename, char *newfilename);
 
+int fs_getall(char *dir_name);
+
+int fs_getall_tar(int fd);
+
 int fs_del(char *filename);
 
 int fs_undel(char *filename);
 
-int fs_df();
+int fs_mkdir(char *dir_name);
+
+int fs_rmdir(char *dir_name);
+
+long fs_df();
+
+int fs_scrub();
 
 #endif
@@ -0,0 +1,72 @@
+// Steven Culwell
+// 1001783662
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include "io.h"
+
+int write_all(int fd, const void *buf, size_t len, off_t offset) {
+  const uint8_t *p = buf;
+  while(len > 0) {
+    ssize_t n = pwrite(fd, p, len, offset);
+    if(n == -1 && errno == EINTR)
+      continue;
+    if(n == -1)
+      return -1;
+    p      += n;
+    len    -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+int read_all(int fd, void *buf, size_t len, off_t offset) {
+  uint8_t *p = buf;
+  while(len > 0) {
+    ssize_t n = pread(fd, p, len, offset);
+    if(n == -1 && errno == EINTR)
+      continue;
+    if(n == -1)
+      return -1;
+    
+    // The file ended early, which pread doesn't report as an error
+    if(n == 0) {
+      errno = EIO;
+      return -1;
+    }
+    p      += n;
+    len    -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+int writev_all(int fd, struct iovec *iov, int count, off_t offset) {
+  while(count > 0) {
+    int batch = count < IOV_MAX ? count : IOV_MAX;
+    ssize_t n = offset == -1 ? writev(fd, iov, batch) : pwritev(fd, iov, batch, offset);
+    if(n == -1 && errno == EINTR)
+      continue;
+    if(n == -1)
+      return -1;
+    if(offset != -1)
+      offset += n;
+    
+    // Skip over the buffers that were fully written, and move the start
+    // of a partially written buffer past the part that was written
+    while(count > 0 && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if(count > 0) {
+      iov->iov_base = (uint8_t *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef CSE3320_IO_H
+#define CSE3320_IO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Write len bytes from buf to fd starting at offset, retrying after partial
+// writes and interrupted calls until everything is written or an error occurs
+int write_all(int fd, const void *buf, size_t len, off_t offset);
+
+// Read len bytes from fd starting at offset into buf, retrying after partial
+// reads and interrupted calls until everything is read. Reaching the end of
+// the file early is an error, which sets errno to EIO.
+int read_all(int fd, void *buf, size_t len, off_t offset);
+
+// Write the buffers described by the count entries of iov to fd starting at
+// offset, IOV_MAX buffers at a time, retrying after partial writes and
+// interrupted calls. iov is
+// modified as the buffers are written. An offset of -1 writes at the current
+// position of fd instead, which also works for pipes.
+int writev_all(int fd, struct iovec *iov, int count, off_t offset);
+
+#endif
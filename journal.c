@@ -0,0 +1,140 @@
+// Steven Culwell
+// 1001783662
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "crc32c.h"
+#include "io.h"
+
+#define JOURNAL_MAGIC   0x4a53464d  // "MFSJ" in little endian
+#define COMMIT_MAGIC    0x4353464d  // "MFSC" in little endian
+
+// Starts each transaction, followed by count block numbers and count blocks
+typedef struct {
+  uint32_t magic;                     // Always JOURNAL_MAGIC
+  uint32_t count;                     // The number of blocks in the transaction
+  uint64_t sequence;                  // Increases by one for each transaction
+} journal_header;
+
+// Ends each transaction
+typedef struct {
+  uint32_t magic;                     // Always COMMIT_MAGIC
+  uint32_t checksum;                  // CRC32C of the header, block numbers and blocks
+  uint64_t sequence;                  // Matches the sequence of the header
+} journal_commit;
+
+int journal_append(int fd, off_t *offset, uint64_t sequence, const uint32_t *numbers,
+    uint8_t **blocks, int count, int block_size) {
+  journal_header header = { JOURNAL_MAGIC, count, sequence };
+  journal_commit commit = { COMMIT_MAGIC, 0, sequence };
+  
+  commit.checksum = crc32c(0, &header, sizeof(header));
+  commit.checksum = crc32c(commit.checksum, numbers, count * sizeof(uint32_t));
+  for(int i = 0; i < count; i++)
+    commit.checksum = crc32c(commit.checksum, blocks[i], block_size);
+  
+  // Gather the whole transaction so it goes out in as few writes as possible
+  struct iovec *iov = malloc((count + 3) * sizeof(struct iovec));
+  iov[0].iov_base = &header;
+  iov[0].iov_len  = sizeof(header);
+  iov[1].iov_base = (void *) numbers;
+  iov[1].iov_len  = count * sizeof(uint32_t);
+  for(int i = 0; i < count; i++) {
+    iov[i + 2].iov_base = blocks[i];
+    iov[i + 2].iov_len  = block_size;
+  }
+  iov[count + 2].iov_base = &commit;
+  iov[count + 2].iov_len  = sizeof(commit);
+  
+  int status = writev_all(fd, iov, count + 3, *offset);
+  free(iov);
+  
+  if(status == -1 || fdatasync(fd) == -1)
+    return -1;
+  
+  *offset += sizeof(header) + count * (sizeof(uint32_t) + block_size) + sizeof(commit);
+  return 0;
+}
+
+// Check that the transaction starting at offset in the journal fd of size
+// journal_size is committed. On success, header and numbers are filled in
+// and the caller must free numbers.
+static bool read_transaction(int fd, off_t offset, off_t journal_size, int num_blocks,
+    int block_size, uint8_t *buf, journal_header *header, uint32_t **numbers) {
+  if(read_all(fd, header, sizeof(journal_header), offset) == -1 ||
+      header->magic != JOURNAL_MAGIC)
+    return false;
+  
+  // Make sure the transaction fits in what is left of the journal before
+  // trusting its count enough to allocate anything
+  off_t size = sizeof(journal_header) + (off_t) header->count * (sizeof(uint32_t) + block_size) +
+    sizeof(journal_commit);
+  if(offset + size > journal_size)
+    return false;
+  
+  *numbers = malloc(header->count * sizeof(uint32_t) + 1);
+  offset += sizeof(journal_header);
+  if(read_all(fd, *numbers, header->count * sizeof(uint32_t), offset) == -1) {
+    free(*numbers);
+    return false;
+  }
+  offset += header->count * sizeof(uint32_t);
+  
+  uint32_t checksum = crc32c(0, header, sizeof(journal_header));
+  checksum = crc32c(checksum, *numbers, header->count * sizeof(uint32_t));
+  for(uint32_t i = 0; i < header->count; i++) {
+    if((*numbers)[i] >= (uint32_t) num_blocks || read_all(fd, buf, block_size, offset) == -1) {
+      free(*numbers);
+      return false;
+    }
+    checksum = crc32c(checksum, buf, block_size);
+    offset += block_size;
+  }
+  
+  journal_commit commit;
+  if(read_all(fd, &commit, sizeof(commit), offset) == -1 || commit.magic != COMMIT_MAGIC ||
+      commit.sequence != header->sequence || commit.checksum != checksum) {
+    free(*numbers);
+    return false;
+  }
+  return true;
+}
+
+int journal_replay(int fd, int image_fd, int num_blocks, int block_size) {
+  struct stat buf;
+  if(fstat(fd, &buf) == -1)
+    return -1;
+  
+  uint8_t *block = malloc(block_size);
+  off_t offset = 0;
+  int replayed = 0;
+  int status = 0;
+  
+  journal_header header;
+  uint32_t *numbers;
+  while(status == 0 &&
+      read_transaction(fd, offset, buf.st_size, num_blocks, block_size, block, &header, &numbers)) {
+    // The transaction is committed, so copy each of its blocks into place
+    off_t data = offset + sizeof(journal_header) + header.count * sizeof(uint32_t);
+    for(uint32_t i = 0; i < header.count && status == 0; i++) {
+      status = read_all(fd, block, block_size, data + (off_t) i * block_size);
+      if(status == 0)
+        status = write_all(image_fd, block, block_size, (off_t) numbers[i] * block_size);
+    }
+    free(numbers);
+    
+    offset += sizeof(journal_header) + (off_t) header.count * (sizeof(uint32_t) + block_size) +
+      sizeof(journal_commit);
+    replayed++;
+  }
+  free(block);
+  
+  if(status == 0 && replayed > 0)
+    status = fdatasync(image_fd);
+  return status == -1 ? -1 : replayed;
+}
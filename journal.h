@@ -0,0 +1,27 @@
+#ifndef CSE3320_JOURNAL_H
+#define CSE3320_JOURNAL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// The journal is a file next to the image holding a sequence of transactions.
+// Each transaction is a header, the numbers of the blocks it changes, the new
+// contents of those blocks, and a commit record with a CRC32C of all of it.
+// A transaction only counts as committed once its commit record is on disk
+// and matches, so a transaction torn by a crash is ignored on replay.
+
+// Append a transaction holding count blocks of block_size bytes to the
+// journal fd at *offset, and flush it to disk. blocks[i] holds the new
+// contents of block numbers[i]. On success *offset is moved past the
+// transaction.
+int journal_append(int fd, off_t *offset, uint64_t sequence, const uint32_t *numbers,
+    uint8_t **blocks, int count, int block_size);
+
+// Write the blocks of every committed transaction in the journal fd to the
+// image image_fd holding num_blocks blocks of block_size bytes, and flush
+// them to disk. Replay stops at the first transaction that is incomplete or
+// doesn't match its commit record. Returns the number of transactions
+// replayed, or -1 if the image could not be written.
+int journal_replay(int fd, int image_fd, int num_blocks, int block_size);
+
+#endif
@@ -0,0 +1,193 @@
+// Steven Culwell
+// 1001783662
+
+// A small LZ77 compressor writing the LZ4 block format. The data is a list of
+// sequences, each made of a token byte, a run of literal bytes copied as they
+// are, and a match copying bytes from earlier in the output:
+//
+//   token           high 4 bits are the number of literals, low 4 bits the
+//                   match length minus LZ_MIN_MATCH. A value of 15 means the
+//                   length continues in the following bytes, each of which
+//                   is added to it until one is not 255
+//   literals
+//   offset          2 bytes, little endian, of how far back the match starts
+//
+// The last sequence only has literals.
+
+#include <string.h>
+#include "lz.h"
+
+#define LZ_MIN_MATCH     4
+#define LZ_MAX_OFFSET    65535
+#define LZ_HASH_BITS     12
+
+// No match may start in the last LZ_MATCH_LIMIT bytes of the input, or
+// reach into the last LZ_LAST_LITERALS bytes, which are always literals
+#define LZ_MATCH_LIMIT   12
+#define LZ_LAST_LITERALS 5
+
+// Once this many positions in a row have not matched, the search starts
+// skipping ahead, so data that doesn't compress is passed over quickly
+#define LZ_SKIP_TRIGGER  6
+
+static inline uint32_t read32(const uint8_t *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static inline int hash4(uint32_t value) {
+  return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Write the part of a length that didn't fit in its 4 bits of the token
+static uint8_t *write_length(uint8_t *op, int len) {
+  while(len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = len;
+  return op;
+}
+
+// Write a sequence of the literals in [anchor, anchor + num_literals), followed
+// by a match of match_len bytes offset bytes back unless match_len is 0.
+// Returns the end of the sequence, or NULL if it doesn't fit before op_end.
+static uint8_t *write_sequence(uint8_t *op, uint8_t *op_end, const uint8_t *anchor,
+    int num_literals, int offset, int match_len) {
+  // Token, literals and their extra length bytes, offset and match length bytes
+  int worst = 1 + num_literals + num_literals / 255 + 1 + 2 + match_len / 255 + 1;
+  if(worst > op_end - op)
+    return NULL;
+
+  uint8_t *token = op++;
+  *token = (num_literals >= 15 ? 15 : num_literals) << 4;
+  if(num_literals >= 15)
+    op = write_length(op, num_literals - 15);
+  memcpy(op, anchor, num_literals);
+  op += num_literals;
+
+  if(match_len == 0)
+    return op;
+
+  *op++ = offset;
+  *op++ = offset >> 8;
+  int extra = match_len - LZ_MIN_MATCH;
+  *token |= extra >= 15 ? 15 : extra;
+  if(extra >= 15)
+    op = write_length(op, extra - 15);
+  return op;
+}
+
+int lz_compress(const uint8_t *src, int len, uint8_t *dst, int cap) {
+  // Last position each hash of 4 bytes was seen at, or -1
+  int table[1 << LZ_HASH_BITS];
+  memset(table, -1, sizeof(table));
+
+  const uint8_t *ip = src;
+  const uint8_t *anchor = src;            // Start of the literals not yet written
+  const uint8_t *end = src + len;
+  uint8_t *op = dst;
+  uint8_t *op_end = dst + cap;
+
+  int misses = 0;
+  while(len > LZ_MATCH_LIMIT && ip < end - LZ_MATCH_LIMIT) {
+    uint32_t sequence = read32(ip);
+    int hash = hash4(sequence);
+    int candidate = table[hash];
+    table[hash] = ip - src;
+
+    if(candidate == -1 || ip - src - candidate > LZ_MAX_OFFSET || read32(src + candidate) != sequence) {
+      ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+      continue;
+    }
+    misses = 0;
+
+    // Extend the match backwards over the literals, then forwards
+    const uint8_t *match = src + candidate;
+    while(ip > anchor && match > src && ip[-1] == match[-1]) {
+      ip--;
+      match--;
+    }
+    int match_len = LZ_MIN_MATCH;
+    while(ip + match_len < end - LZ_LAST_LITERALS && ip[match_len] == match[match_len])
+      match_len++;
+
+    op = write_sequence(op, op_end, anchor, ip - anchor, ip - match, match_len);
+    if(op == NULL)
+      return 0;
+
+    ip += match_len;
+    anchor = ip;
+
+    // Remember a position inside the match as well, which often
+    // starts the next one
+    if(ip < end - LZ_MATCH_LIMIT)
+      table[hash4(read32(ip - 2))] = ip - 2 - src;
+  }
+
+  op = write_sequence(op, op_end, anchor, end - anchor, 0, 0);
+  return op == NULL ? 0 : op - dst;
+}
+
+// Add the extra bytes of a length that didn't fit in its 4 bits of the
+// token to len. Returns -1 if the input ends first.
+static int read_length(const uint8_t **ip, const uint8_t *end, int *len) {
+  int byte;
+  do {
+    if(*ip == end)
+      return -1;
+    byte = *(*ip)++;
+    *len += byte;
+  } while(byte == 255);
+  return 0;
+}
+
+int lz_decompress(const uint8_t *src, int len, uint8_t *dst, int cap) {
+  const uint8_t *ip = src;
+  const uint8_t *end = src + len;
+  uint8_t *op = dst;
+  uint8_t *op_end = dst + cap;
+
+  while(ip < end) {
+    int token = *ip++;
+
+    int num_literals = token >> 4;
+    if(num_literals == 15 && read_length(&ip, end, &num_literals) == -1)
+      return -1;
+    if(num_literals > end - ip || num_literals > op_end - op)
+      return -1;
+    memcpy(op, ip, num_literals);
+    ip += num_literals;
+    op += num_literals;
+
+    // The last sequence ends after its literals
+    if(ip == end)
+      break;
+
+    if(end - ip < 2)
+      return -1;
+    int offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    if(offset == 0 || offset > op - dst)
+      return -1;
+
+    int match_len = token & 15;
+    if(match_len == 15 && read_length(&ip, end, &match_len) == -1)
+      return -1;
+    match_len += LZ_MIN_MATCH;
+    if(match_len > op_end - op)
+      return -1;
+
+    // A match can overlap the bytes it is writing, repeating them
+    const uint8_t *match = op - offset;
+    if(offset >= match_len) {
+      memcpy(op, match, match_len);
+    } else {
+      for(int i = 0; i < match_len; i++)
+        op[i] = match[i];
+    }
+    op += match_len;
+  }
+  return op - dst;
+}
@@ -0,0 +1,19 @@
+#ifndef CSE3320_LZ_H
+#define CSE3320_LZ_H
+
+#include <stdint.h>
+
+// Largest number of bytes that compressing len bytes can take
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+// Compress len bytes of src into dst, which has room for cap bytes, using
+// the LZ4 block format. Returns the size of the compressed data, or 0 if
+// it doesn't fit in cap bytes.
+int lz_compress(const uint8_t *src, int len, uint8_t *dst, int cap);
+
+// Decompress len bytes of src into dst, which has room for cap bytes.
+// Returns the size of the decompressed data, or -1 if src is corrupt or
+// decompresses to more than cap bytes.
+int lz_decompress(const uint8_t *src, int len, uint8_t *dst, int cap);
+
+#endif
@@ -32,22 +32,27 @@
 #include <errno.h>
 #include <string.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <limits.h>
 
 #include "filesystem.h"
+#include "stats.h"
 
 #define WHITESPACE " \t\n"      // We want to split our command line up into tokens
                                 // so we need to define what delimits our tokens.
                                 // In this case  white space
                                 // will separate the tokens on our command line
 
-#define MAX_COMMAND_SIZE 255    // The maximum command-line size
+#define MAX_COMMAND_SIZE 4096   // The maximum command-line size, enough for long paths
 
-#define MAX_NUM_ARGUMENTS 5     // Mav shell only supports five arguments
+#define MAX_NUM_ARGUMENTS 12    // Enough for the longest createfs command
 
-// put <filename>: Copy the local file to the filesystem image
+// put <filename>: Copy the local file to the same path in the filesystem image
+// put <filename> <newfilename>: Copy the local file to the path <newfilename>
+// in the filesystem image
 int put_cmd(char **token, int token_count) {
-  if(token_count != 3) {
-    printf("put error: Expected `put <filename>`\n");
+  if(token_count != 3 && token_count != 4) {
+    printf("put error: Expected `put <filename>` or `put <filename> <newfilename>`\n");
     return -1;
   }
   
@@ -57,7 +62,38 @@ int put_cmd(char **token, int token_count) {
     return -1;
   }
   
-  return fs_put(filename);
+  char *newfilename = NULL;
+  if(token_count == 4)
+    newfilename = token[2];
+  
+  return fs_put(filename, newfilename);
+}
+
+// putdir <dir>: Copy every file in the local directory to the filesystem image
+// putdir <dir> <pattern>: Copy only the files with names matching pattern
+// putdir <dir> <pattern> <destination>: Copy them into the directory
+// <destination> of the filesystem image instead of the root directory
+int putdir_cmd(char **token, int token_count) {
+  if(token_count < 3 || token_count > 5) {
+    printf("putdir error: Expected `putdir <dir>`, `putdir <dir> <pattern>` or `putdir <dir> <pattern> <destination>`\n");
+    return -1;
+  }
+  
+  char *dir_name = token[1];
+  if(!dir_name) {
+    printf("putdir error: Directory name must not be empty\n");
+    return -1;
+  }
+  
+  char *pattern = NULL;
+  if(token_count >= 4)
+    pattern = token[2];
+  
+  char *dest_name = NULL;
+  if(token_count == 5)
+    dest_name = token[3];
+  
+  return fs_putdir(dir_name, pattern, dest_name);
 }
 
 // get <filename>: Retrieve the file from the filesystem image
@@ -88,6 +124,42 @@ int get_cmd(char **token, int token_count) {
   
 }
 
+// getall <dir>: Retrieve every file from the filesystem image into the directory
+// getall -t <archive>: Retrieve every file from the filesystem image as a tar
+// archive, which is written to stdout if archive is -
+int getall_cmd(char **token, int token_count) {
+  bool tar = token_count == 4 && token[1] && strncmp("-t", token[1], 3) == 0;
+  if(token_count != 3 && !tar) {
+    printf("getall error: Expected `getall <dir>` or `getall -t <archive>`\n");
+    return -1;
+  }
+  
+  char *name = token[token_count - 2];
+  if(!name) {
+    printf("getall error: %s name must not be empty\n", tar ? "Archive" : "Directory");
+    return -1;
+  }
+  
+  if(!tar)
+    return fs_getall(name);
+  
+  if(strncmp("-", name, 2) == 0) {
+    fflush(stdout);
+    return fs_getall_tar(STDOUT_FILENO);
+  }
+  
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1) {
+    printf("getall error: Could not open file \"%s\": ", name);
+    fflush(stdout);
+    perror("");
+    return -1;
+  }
+  int result = fs_getall_tar(fd);
+  close(fd);
+  return result;
+}
+
 // del <filename>: Delete the file
 int del_cmd(char **token, int token_count) {
   if(token_count != 3) {
@@ -120,15 +192,54 @@ int undel_cmd(char **token, int token_count) {
   return fs_undel(filename);
 }
 
-// list [-h]: List the files in the file system image
+// list [-h]: List the files in the root directory of the file system image
+// list [-h] <dir>: List the files in the directory
 int list_cmd(char **token, int token_count) {
-  if(token_count != 3 && token_count != 2) {
-    printf("list error: Expected `list [-h]`\n");
+  if(token_count < 2 || token_count > 4) {
+    printf("list error: Expected `list [-h] [<dir>]`\n");
+    return -1;
+  }
+  
+  bool show_hidden = token_count > 2 && token[1] && strncmp("-h", token[1], 3) == 0;
+  if(token_count == 4 && !show_hidden) {
+    printf("list error: Expected `list [-h] [<dir>]`\n");
+    return -1;
+  }
+  
+  char *dir_name = token_count - 2 > show_hidden ? token[token_count - 2] : NULL;
+  return fs_list(dir_name, show_hidden);
+}
+
+// mkdir <dir>: Make a new directory in the file system image
+int mkdir_cmd(char **token, int token_count) {
+  if(token_count != 3) {
+    printf("mkdir error: Expected `mkdir <dir>`\n");
+    return -1;
+  }
+  
+  char *dir_name = token[1];
+  if(!dir_name) {
+    printf("mkdir error: Directory name must not be empty\n");
+    return -1;
+  }
+  
+  return fs_mkdir(dir_name);
+}
+
+// rmdir <dir>: Remove the empty directory
+int rmdir_cmd(char **token, int token_count) {
+  if(token_count != 3) {
+    printf("rmdir error: Expected `rmdir <dir>`\n");
+    return -1;
+  }
+  
+  char *dir_name = token[1];
+  if(!dir_name) {
+    printf("rmdir error: Directory name must not be empty\n");
     return -1;
   }
   
-  bool show_hidden = token_count == 3 && token[1] && strncmp("-h", token[1], 3) == 0;
-  return fs_list(show_hidden);
+  return fs_rmdir(dir_name);
 }
 
 // df: Display the amount of disk space left in the file system
@@ -138,26 +249,39 @@ int df_cmd(char **token, int token_count) {
     return -1;
   }
   
-  int df = fs_df();
-  printf("%d bytes free\n", df);
+  long df = fs_df();
+  if(df == -1)
+    return -1;
+  printf("%ld bytes free\n", df);
   
   return 0;
 }
 
-// open <file image name>: Open a file system image
+// open [-m] <file image name>: Open a file system image. If the `-m` flag
+// is set, the image file is mapped into memory instead of being read in
 int open_cmd(char **token, int token_count) {
-  if(token_count != 3) {
-    printf("open error: Expected `open <file image name>`\n");
+  if(token_count != 3 && token_count != 4) {
+    printf("open error: Expected `open [-m] <file image name>`\n");
     return -1;
   }
   
+  open_flag flags = 0;
   char *file_image_name = token[1];
+  if(token_count == 4) {
+    if(!token[1] || strncmp("-m", token[1], 3) != 0) {
+      printf("open error: Expected `open [-m] <file image name>`\n");
+      return -1;
+    }
+    flags |= FS_MMAP;
+    file_image_name = token[2];
+  }
+  
   if(!file_image_name) {
     printf("open error: File image name must not be empty\n");
     return -1;
   }
   
-  return fs_open(file_image_name);
+  return fs_open_flags(file_image_name, flags);
 }
 
 // close: Close the currently opened file system
@@ -175,21 +299,79 @@ int close_cmd(char **token, int token_count) {
   return result;
 }
 
-// createfs <disk image name>: Create a new file system image
+// Parse the value given to createfs after option, which must be a
+// positive number. Returns -1 if it isn't one.
+static int parse_geometry(char *option, char *value) {
+  char *end;
+  long number = value ? strtol(value, &end, 10) : 0;
+  if(!value || *end != 0 || number <= 0 || number > INT_MAX) {
+    printf("createfs error: Expected a positive number after `%s`\n", option);
+    return -1;
+  }
+  return number;
+}
+
+// createfs [-p] [-d] [-c] [-b <block size>] [-n <block count>] [-i <inode count>]
+// <disk image name>: Create a new file system image.
+// If the `-p` flag is set, disk space is reserved for the whole image up
+// front. If the `-d` flag is set, blocks holding the same data are shared
+// between files. If the `-c` flag is set, files are compressed. Flags can
+// be combined into one, as in `-dc`. The `-b`, `-n` and `-i` options set
+// the size of each block, the number of blocks and the number of inodes.
 int createfs_cmd(char **token, int token_count) {
-  // Command should have 2 tokens
-  if(token_count != 3) {
-    printf("createfs error: Expected `createfs <disk image name>`\n");
+  // Command should have between 2 and 10 tokens
+  if(token_count < 3 || token_count > 11) {
+    printf("createfs error: Expected `createfs [-p] [-d] [-c] [-b <block size>] [-n <block count>] "
+        "[-i <inode count>] <disk image name>`\n");
     return 1;
   }
   
-  char *disk_image_name = token[1];
+  create_flag flags = 0;
+  mfs_geometry geometry = { 0 };
+  char *disk_image_name = token[token_count - 2];
+  for(int i = 1; i < token_count - 2; i++) {
+    if(!token[i] || token[i][0] != '-' || token[i][1] == 0) {
+      printf("createfs error: Expected `createfs [-p] [-d] [-c] [-b <block size>] [-n <block count>] "
+          "[-i <inode count>] <disk image name>`\n");
+      return -1;
+    }
+    
+    // Each geometry option takes the token after it as its value
+    int *value = NULL;
+    if(strncmp("-b", token[i], 3) == 0)
+      value = &geometry.block_size;
+    else if(strncmp("-n", token[i], 3) == 0)
+      value = &geometry.num_blocks;
+    else if(strncmp("-i", token[i], 3) == 0)
+      value = &geometry.max_files;
+    if(value) {
+      i++;
+      *value = parse_geometry(token[i - 1], i < token_count - 2 ? token[i] : NULL);
+      if(*value == -1)
+        return -1;
+      continue;
+    }
+    
+    for(char *flag = token[i] + 1; *flag; flag++) {
+      if(*flag == 'p') {
+        flags |= FS_PREALLOCATE;
+      } else if(*flag == 'd') {
+        flags |= FS_DEDUP;
+      } else if(*flag == 'c') {
+        flags |= FS_COMPRESS;
+      } else {
+        printf("createfs error: Invalid flag `-%c`\n", *flag);
+        return -1;
+      }
+    }
+  }
+  
   if(!disk_image_name) {
     printf("createfs error: Disk image name must not be empty\n");
     return -1;
   }
   
-  return fs_createfs(disk_image_name);
+  return fs_createfs_geometry(disk_image_name, flags, &geometry);
 }
 
 // savefs: Save the current file system image
@@ -228,6 +410,32 @@ is either 'r' or 'h'\n");
   return fs_setattrib(token[2], a, enabled);
 }
 
+// stats: Print the latency, error and byte counts of every operation so far
+// stats -r: Clear them
+int stats_cmd(char **token, int token_count) {
+  bool reset = token_count == 3 && token[1] && strncmp("-r", token[1], 3) == 0;
+  if(token_count != 2 && !reset) {
+    printf("stats error: Expected `stats [-r]`\n");
+    return -1;
+  }
+  
+  if(reset)
+    stats_reset();
+  else
+    stats_print();
+  return 0;
+}
+
+// scrub: Check every block of every file against its checksum
+int scrub_cmd(char **token, int token_count) {
+  if(token_count != 2) {
+    printf("scrub error: Expected `scrub`\n");
+    return -1;
+  }
+  
+  return fs_scrub() == -1 ? -1 : 0;
+}
+
 int main() {
 
   char * cmd_str = (char*) malloc( MAX_COMMAND_SIZE );
@@ -282,14 +490,22 @@ int main() {
       running = 0;
     } else if(strncmp("put", token[0], MAX_COMMAND_SIZE) == 0) {
       put_cmd(token, token_count);
+    } else if(strncmp("putdir", token[0], MAX_COMMAND_SIZE) == 0) {
+      putdir_cmd(token, token_count);
     } else if(strncmp("get", token[0], MAX_COMMAND_SIZE) == 0) {
       get_cmd(token, token_count);
+    } else if(strncmp("getall", token[0], MAX_COMMAND_SIZE) == 0) {
+      getall_cmd(token, token_count);
     } else if(strncmp("del", token[0], MAX_COMMAND_SIZE) == 0) {
       del_cmd(token, token_count);
     } else if(strncmp("undel", token[0], MAX_COMMAND_SIZE) == 0) {
       undel_cmd(token, token_count);
     } else if(strncmp("list", token[0], MAX_COMMAND_SIZE) == 0) {
       list_cmd(token, token_count);
+    } else if(strncmp("mkdir", token[0], MAX_COMMAND_SIZE) == 0) {
+      mkdir_cmd(token, token_count);
+    } else if(strncmp("rmdir", token[0], MAX_COMMAND_SIZE) == 0) {
+      rmdir_cmd(token, token_count);
     } else if(strncmp("df", token[0], MAX_COMMAND_SIZE) == 0) {
       df_cmd(token, token_count);
     } else if(strncmp("open", token[0], MAX_COMMAND_SIZE) == 0) {
@@ -302,6 +518,10 @@ int main() {
       savefs_cmd(token, token_count);
     } else if(strncmp("attrib", token[0], MAX_COMMAND_SIZE) == 0) {
       attrib_cmd(token, token_count);
+    } else if(strncmp("stats", token[0], MAX_COMMAND_SIZE) == 0) {
+      stats_cmd(token, token_count);
+    } else if(strncmp("scrub", token[0], MAX_COMMAND_SIZE) == 0) {
+      scrub_cmd(token, token_count);
     } else {
       printf("mfs error: Unknown command: `%s`\n", token[0]);
     }
@@ -0,0 +1,141 @@
+// Steven Culwell
+// 1001783662
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include "stats.h"
+
+#ifndef MFS_NO_STATS
+
+// Latencies are counted in buckets whose width grows with the latency, so
+// that each is recorded to within about 3% with a fixed amount of memory,
+// like an HDR histogram. Latencies below 2^SUB_BITS nanoseconds each get
+// their own bucket. Above that, each power of two is split into 2^SUB_BITS
+// buckets of equal width.
+#define SUB_BITS        5
+#define SUB_BUCKETS     (1 << SUB_BITS)
+#define NUM_BUCKETS     ((64 - SUB_BITS + 1) * SUB_BUCKETS)
+
+typedef struct {
+  uint64_t count;                     // Number of calls
+  uint64_t errors;                    // Number of calls that failed
+  uint64_t bytes;                     // Bytes of file data moved by the calls
+  uint64_t total_ns;                  // Sum of the latencies of the calls
+  uint64_t max_ns;                    // Longest latency of any call
+  uint64_t buckets[NUM_BUCKETS];      // Number of calls with a latency in each bucket
+} op_stats;
+
+static op_stats stats[STATS_NUM_OPS];
+
+static const char *op_names[STATS_NUM_OPS] = {
+  [STATS_CREATEFS] = "createfs",
+  [STATS_OPEN]     = "open",
+  [STATS_CLOSE]    = "close",
+  [STATS_SAVEFS]   = "savefs",
+  [STATS_ATTRIB]   = "attrib",
+  [STATS_LIST]     = "list",
+  [STATS_PUT]      = "put",
+  [STATS_PUTDIR]   = "putdir",
+  [STATS_GET]      = "get",
+  [STATS_GETALL]   = "getall",
+  [STATS_DEL]      = "del",
+  [STATS_UNDEL]    = "undel",
+  [STATS_MKDIR]    = "mkdir",
+  [STATS_RMDIR]    = "rmdir",
+  [STATS_DF]       = "df",
+  [STATS_SCRUB]    = "scrub",
+};
+
+// Return the bucket counting latencies of ns nanoseconds
+static int bucket_of(uint64_t ns) {
+  if(ns < SUB_BUCKETS)
+    return ns;
+  int exponent = 63 - __builtin_clzll(ns);
+  int sub = (ns >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1);
+  return (exponent - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+// Return the longest latency counted in bucket
+static uint64_t bucket_max(int bucket) {
+  if(bucket < SUB_BUCKETS)
+    return bucket;
+  int shift = bucket / SUB_BUCKETS - 1;
+  uint64_t lowest = (uint64_t) (SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+  return lowest + (UINT64_C(1) << shift) - 1;
+}
+
+uint64_t stats_start() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_record(stats_op op, uint64_t start, int status, uint64_t bytes) {
+  uint64_t ns = stats_start() - start;
+  op_stats *s = &stats[op];
+  
+  // Operations can run on any number of threads at once, so every counter
+  // is updated atomically. Nothing else needs to be ordered against them.
+  __atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->total_ns, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+  if(status == -1)
+    __atomic_fetch_add(&s->errors, 1, __ATOMIC_RELAXED);
+  if(bytes)
+    __atomic_fetch_add(&s->bytes, bytes, __ATOMIC_RELAXED);
+  
+  uint64_t max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+  while(ns > max && !__atomic_compare_exchange_n(&s->max_ns, &max, ns, true,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Return the latency in microseconds that percent percent of the calls in
+// s took no longer than
+static double percentile(op_stats *s, uint64_t count, int percent) {
+  uint64_t wanted = (count * percent + 99) / 100;
+  uint64_t max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+  
+  // The bucket can reach past the longest latency that was actually seen
+  uint64_t seen = 0;
+  for(int i = 0; i < NUM_BUCKETS; i++) {
+    seen += __atomic_load_n(&s->buckets[i], __ATOMIC_RELAXED);
+    if(seen >= wanted)
+      return (bucket_max(i) < max ? bucket_max(i) : max) / 1000.0;
+  }
+  return max / 1000.0;
+}
+
+void stats_print() {
+  printf("%-8s %8s %6s %12s %10s %10s %10s %10s %10s\n", "op", "count", "errors",
+      "bytes", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+  for(int op = 0; op < STATS_NUM_OPS; op++) {
+    op_stats *s = &stats[op];
+    uint64_t count = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+    if(count == 0)
+      continue;
+    
+    printf("%-8s %8" PRIu64 " %6" PRIu64 " %12" PRIu64 " %10.2f %10.2f %10.2f %10.2f %10.2f\n", op_names[op],
+        count, s->errors, s->bytes, s->total_ns / 1000.0 / count, percentile(s, count, 50),
+        percentile(s, count, 90), percentile(s, count, 99), s->max_ns / 1000.0);
+  }
+}
+
+void stats_reset() {
+  memset(stats, 0, sizeof(stats));
+}
+
+#else
+
+void stats_print() {
+  printf("stats error: Statistics were left out of this build\n");
+}
+
+void stats_reset() {
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef CSE3320_STATS_H
+#define CSE3320_STATS_H
+
+#include <stdint.h>
+
+// Every filesystem operation is timed and its latency kept in a histogram
+// for that kind of operation, along with the number of calls, the number
+// that failed and the number of bytes they moved. The statistics are shared
+// by every handle in the process. Building with -DMFS_NO_STATS removes all of
+// it, leaving nothing but empty calls that the compiler throws away.
+
+typedef enum {
+  STATS_CREATEFS,
+  STATS_OPEN,
+  STATS_CLOSE,
+  STATS_SAVEFS,
+  STATS_ATTRIB,
+  STATS_LIST,
+  STATS_PUT,
+  STATS_PUTDIR,
+  STATS_GET,
+  STATS_GETALL,
+  STATS_DEL,
+  STATS_UNDEL,
+  STATS_MKDIR,
+  STATS_RMDIR,
+  STATS_DF,
+  STATS_SCRUB,
+  STATS_NUM_OPS,
+} stats_op;
+
+#ifndef MFS_NO_STATS
+
+// Return the time to pass to stats_record once the operation is done
+uint64_t stats_start();
+
+// Record a call of op that started at start, failed if status is -1, and
+// read or wrote bytes bytes of file data
+void stats_record(stats_op op, uint64_t start, int status, uint64_t bytes);
+
+#else
+
+static inline uint64_t stats_start() { return 0; }
+static inline void stats_record(stats_op op, uint64_t start, int status, uint64_t bytes) {}
+
+#endif
+
+// Print the statistics of every operation that has been called
+void stats_print();
+
+// Clear the statistics of every operation
+void stats_reset();
+
+#endif
@@ -0,0 +1,609 @@
+// Steven Culwell
+// 1001783662
+
+// Tests for the filesystem. Each test drives the mfs_* functions on images
+// of its own and checks the files read back out against the ones put in.
+// A line is printed for each test that fails, and the exit status is the
+// number of tests that failed.
+//
+// Everything runs in a temporary directory that is removed afterwards.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "filesystem.h"
+
+#define IMAGE_NAME      "test.img"
+
+// Most seconds a test waits on another thread before it counts as stuck
+#define STALL_SECONDS   10
+
+// Where failures are reported, which is stdout as it was when the tests started
+static FILE *results;
+
+// Name of the test running, and whether any of its checks failed
+static const char *test_name;
+static bool test_failed;
+
+// Fail the running test with the message printed after it unless condition holds
+#define CHECK(condition, ...) do {                                      \
+    if(!(condition)) {                                                  \
+      fprintf(results, "FAIL %s (line %d): ", test_name, __LINE__);     \
+      fprintf(results, __VA_ARGS__);                                    \
+      fprintf(results, "\n");                                           \
+      test_failed = true;                                               \
+    }                                                                   \
+  } while(0)
+
+// Create a local file named name holding size bytes made from seed. Low
+// seeds give data that compresses well, high ones data that doesn't.
+static void make_file(char *name, int size, int seed) {
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  uint8_t *data = malloc(size > 0 ? size : 1);
+  uint32_t x = seed * 2654435761u + 1;
+  for(int i = 0; i < size; i++) {
+    x = x * 1103515245 + 12345;
+    data[i] = seed < 16 ? "abcdefgh"[(i / 7 + seed) % 8] : x >> 24;
+  }
+  if(fd == -1 || write(fd, data, size) != size) {
+    fprintf(results, "test: could not create %s\n", name);
+    exit(1);
+  }
+  free(data);
+  close(fd);
+}
+
+// Read the whole local file name into a new buffer, setting *size to its
+// length. Returns NULL if it can't be read.
+static uint8_t *read_local(const char *name, long *size) {
+  FILE *f = fopen(name, "rb");
+  if(f == NULL)
+    return NULL;
+  fseek(f, 0, SEEK_END);
+  *size = ftell(f);
+  rewind(f);
+  uint8_t *data = malloc(*size > 0 ? *size : 1);
+  if(fread(data, 1, *size, f) != (size_t) *size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+  return data;
+}
+
+// Copy the local file from to the local file to, cut short after size
+// bytes if size is not -1
+static void copy_local(const char *from, const char *to, long size) {
+  long from_size;
+  uint8_t *data = read_local(from, &from_size);
+  if(size == -1 || size > from_size)
+    size = from_size;
+  int fd = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(data == NULL || fd == -1 || write(fd, data, size) != size) {
+    fprintf(results, "test: could not copy %s to %s\n", from, to);
+    exit(1);
+  }
+  free(data);
+  close(fd);
+}
+
+// Return the size of the local file name, or -1 if it doesn't exist
+static long local_size(const char *name) {
+  struct stat st;
+  return stat(name, &st) == -1 ? -1 : st.st_size;
+}
+
+// Return true if the local files a and b both exist and hold the same data
+static bool same_file(const char *a, const char *b) {
+  long size_a, size_b;
+  uint8_t *data_a = read_local(a, &size_a);
+  uint8_t *data_b = read_local(b, &size_b);
+  bool same = data_a != NULL && data_b != NULL && size_a == size_b &&
+      memcmp(data_a, data_b, size_a) == 0;
+  free(data_a);
+  free(data_b);
+  return same;
+}
+
+// Return true if getting the file name out of h gives the same data as the
+// local file of the same name
+static bool get_same(mfs_t *h, char *name) {
+  unlink("got");
+  return mfs_get(h, name, "got") == 0 && same_file("got", name);
+}
+
+// Create an image with flags and geometry, which may be NULL, and open it
+static mfs_t *new_image(create_flag flags, const mfs_geometry *geometry) {
+  unlink(IMAGE_NAME ".journal");
+  if(mfs_createfs(IMAGE_NAME, flags, geometry) == -1)
+    return NULL;
+  return mfs_open(IMAGE_NAME, 0);
+}
+
+// Fail the test that a thread is waiting on once it has taken too long
+static void stalled(int sig) {
+  fprintf(results, "FAIL %s: stalled for %d seconds\n", test_name, STALL_SECONDS);
+  _exit(1);
+}
+
+// A get, getall or del run on a thread of its own
+typedef struct {
+  mfs_t *h;
+  char *filename;
+  char *newfilename;
+  int status;
+  bool done;
+} op_thread;
+
+static void *get_thread(void *arg) {
+  op_thread *op = arg;
+  op->status = mfs_get(op->h, op->filename, op->newfilename);
+  __atomic_store_n(&op->done, true, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static void *getall_thread(void *arg) {
+  op_thread *op = arg;
+  op->status = mfs_getall(op->h, op->newfilename);
+  __atomic_store_n(&op->done, true, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static void *del_thread(void *arg) {
+  op_thread *op = arg;
+  op->status = mfs_del(op->h, op->filename);
+  __atomic_store_n(&op->done, true, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// A del of a file that is being read out waits for the get, but lists,
+// puts and mkdirs go on meanwhile. The get opens a pipe, which blocks with
+// the file locked until the other end is opened once they are done. The
+// get can't write into a pipe, so it fails after that.
+static void test_del_during_get() {
+  mfs_t *h = new_image(0, NULL);
+  make_file("big", 1048576, 99);
+  make_file("small", 100, 98);
+  mkfifo("pipe", 0644);
+  CHECK(mfs_put(h, "big", NULL) == 0, "put big");
+
+  op_thread get = { h, "big", "pipe" };
+  op_thread del = { h, "big" };
+  pthread_t get_tid, del_tid;
+  pthread_create(&get_tid, NULL, get_thread, &get);
+  usleep(100000);
+  pthread_create(&del_tid, NULL, del_thread, &del);
+  usleep(100000);
+
+  alarm(STALL_SECONDS);
+  CHECK(mfs_list(h, NULL, false) == 0, "list during del");
+  CHECK(mfs_put(h, "small", NULL) == 0, "put during del");
+  CHECK(mfs_mkdir(h, "d") == 0, "mkdir during del");
+  CHECK(!__atomic_load_n(&del.done, __ATOMIC_ACQUIRE), "del did not wait for the get");
+
+  close(open("pipe", O_RDONLY));
+  pthread_join(get_tid, NULL);
+  pthread_join(del_tid, NULL);
+  alarm(0);
+
+  CHECK(del.status == 0, "del during get");
+  CHECK(mfs_get(h, "big", "got") == -1, "get after del");
+  CHECK(mfs_undel(h, "big") == 0 && get_same(h, "big"), "undel after del");
+  CHECK(get_same(h, "small"), "get of file put during del");
+  mfs_close(h);
+}
+
+// A getall only locks each file while it writes it out, so a del of another
+// file finishes while it runs, and a del of the file it is writing waits
+// without holding up lists and puts. The getall writes into a pipe in place
+// of one of the files, which blocks it until the other end is opened.
+static void test_del_during_getall() {
+  mfs_t *h = new_image(0, NULL);
+  make_file("big", 300000, 97);
+  make_file("other", 5000, 96);
+  make_file("small", 100, 95);
+  CHECK(mfs_put(h, "big", NULL) == 0 && mfs_put(h, "other", NULL) == 0, "put files");
+  mkdir("out", 0755);
+  mkfifo("out/big", 0644);
+
+  op_thread getall = { h, NULL, "out" };
+  op_thread del = { h, "big" };
+  pthread_t getall_tid, del_tid;
+  pthread_create(&getall_tid, NULL, getall_thread, &getall);
+  usleep(100000);
+  pthread_create(&del_tid, NULL, del_thread, &del);
+  usleep(100000);
+
+  alarm(STALL_SECONDS);
+  CHECK(mfs_del(h, "other") == 0, "del of another file during getall");
+  CHECK(mfs_list(h, NULL, false) == 0, "list during getall");
+  CHECK(mfs_put(h, "small", NULL) == 0, "put during getall");
+  CHECK(!__atomic_load_n(&del.done, __ATOMIC_ACQUIRE), "del did not wait for the getall");
+
+  close(open("out/big", O_RDONLY));
+  pthread_join(getall_tid, NULL);
+  pthread_join(del_tid, NULL);
+  alarm(0);
+
+  CHECK(del.status == 0, "del during getall");
+  CHECK(mfs_undel(h, "big") == 0 && get_same(h, "big"), "undel after getall");
+  mfs_close(h);
+}
+
+// Open the image crash.img made from the image and journal left behind by
+// test_journal_replay, with the journal cut short after journal_size bytes
+// if it is not -1, and the byte at garbled flipped if it is not -1
+static mfs_t *open_crashed(long journal_size, long garbled) {
+  copy_local("saved.img", "crash.img", -1);
+  copy_local("saved.img.journal", "crash.img.journal", journal_size);
+  if(garbled != -1) {
+    int fd = open("crash.img.journal", O_RDWR);
+    uint8_t byte = 0;
+    pread(fd, &byte, 1, garbled);
+    byte ^= 0xff;
+    pwrite(fd, &byte, 1, garbled);
+    close(fd);
+  }
+  return mfs_open("crash.img", 0);
+}
+
+// Saved transactions are replayed from the journal when an image is opened
+// after a crash, while one torn by the crash is left out along with
+// everything after it. The crash is made by closing the image with changes
+// that were never saved, which leaves the journal in place.
+static void test_journal_replay() {
+  mfs_t *h = new_image(0, NULL);
+  make_file("first", 20000, 94);
+  make_file("second", 30000, 93);
+  make_file("third", 100, 92);
+  CHECK(mfs_put(h, "first", NULL) == 0 && mfs_savefs(h) == 0, "save first");
+  long first_size = local_size(IMAGE_NAME ".journal");
+  CHECK(mfs_put(h, "second", NULL) == 0 && mfs_savefs(h) == 0, "save second");
+  CHECK(mfs_del(h, "first") == 0 && mfs_put(h, "third", NULL) == 0, "unsaved changes");
+  mfs_close(h);
+
+  long journal_size = local_size(IMAGE_NAME ".journal");
+  CHECK(first_size > 0 && journal_size > first_size, "journal holds both saves");
+  copy_local(IMAGE_NAME, "saved.img", -1);
+  copy_local(IMAGE_NAME ".journal", "saved.img.journal", -1);
+
+  // The whole journal
+  h = open_crashed(-1, -1);
+  CHECK(h != NULL, "open after crash");
+  CHECK(get_same(h, "first") && get_same(h, "second"), "get of saved files");
+  CHECK(mfs_get(h, "third", "got") == -1, "get of unsaved file");
+  mfs_close(h);
+  CHECK(local_size("crash.img.journal") == 0, "journal emptied by replay");
+
+  // What was replayed is in the image itself once it has been opened
+  h = mfs_open("crash.img", 0);
+  CHECK(h != NULL && get_same(h, "first") && get_same(h, "second"), "get after replay");
+  mfs_close(h);
+
+  // The commit record of the second save torn off
+  h = open_crashed(journal_size - 1, -1);
+  CHECK(h != NULL && get_same(h, "first"), "get of file saved before torn commit");
+  CHECK(mfs_get(h, "second", "got") == -1, "get of file with torn commit");
+  mfs_close(h);
+
+  // Torn in the middle of the blocks of the second save
+  h = open_crashed((first_size + journal_size) / 2, -1);
+  CHECK(h != NULL && get_same(h, "first"), "get of file saved before torn blocks");
+  CHECK(mfs_get(h, "second", "got") == -1, "get of file with torn blocks");
+  mfs_close(h);
+
+  // Every byte of the second save written, but one of them wrong
+  h = open_crashed(-1, (first_size + journal_size) / 2);
+  CHECK(h != NULL && get_same(h, "first"), "get of file saved before garbled blocks");
+  CHECK(mfs_get(h, "second", "got") == -1, "get of file with garbled blocks");
+  mfs_close(h);
+
+  // Torn in the header of the first save, which leaves nothing to replay
+  h = open_crashed(5, -1);
+  CHECK(h != NULL, "open with torn header");
+  CHECK(mfs_get(h, "first", "got") == -1 && mfs_get(h, "second", "got") == -1, "get with torn header");
+  mfs_close(h);
+}
+
+// Identical blocks are shared between files in dedup mode, and each is only
+// freed once the last file holding it is deleted. An undel takes back the
+// blocks of the file whether or not other files still hold them.
+static void test_dedup_refcounts() {
+  mfs_t *h = new_image(FS_DEDUP, NULL);
+  long block = 8192;                   // Block size of the default geometry
+  long empty = mfs_df(h);
+
+  // b is a copy of a, and c shares the first 3 of its 5 blocks
+  make_file("a", 5 * block, 91);
+  copy_local("a", "b", -1);
+  make_file("tail", 2 * block, 90);
+  copy_local("a", "c", 3 * block);
+  long tail_size;
+  uint8_t *tail = read_local("tail", &tail_size);
+  int fd = open("c", O_WRONLY | O_APPEND);
+  CHECK(write(fd, tail, tail_size) == tail_size, "make c");
+  close(fd);
+  free(tail);
+
+  CHECK(mfs_put(h, "a", NULL) == 0, "put a");
+  CHECK(mfs_df(h) == empty - 5 * block, "df after put a");
+  CHECK(mfs_put(h, "b", NULL) == 0, "put b");
+  CHECK(mfs_df(h) == empty - 5 * block, "df after put of copy b");
+  CHECK(mfs_put(h, "c", NULL) == 0, "put c");
+  long all = mfs_df(h);
+  CHECK(all == empty - 7 * block, "df after put of c sharing 3 blocks");
+
+  CHECK(mfs_del(h, "a") == 0 && mfs_df(h) == all, "df after del a");
+  CHECK(get_same(h, "b") && get_same(h, "c"), "get of files sharing a's blocks");
+  CHECK(mfs_del(h, "b") == 0 && mfs_df(h) == all + 2 * block, "df after del b");
+  CHECK(mfs_undel(h, "b") == 0 && mfs_df(h) == all, "df after undel b");
+  CHECK(mfs_undel(h, "a") == 0 && mfs_df(h) == all, "df after undel a");
+  CHECK(get_same(h, "a") && get_same(h, "b") && get_same(h, "c"), "get after undel");
+
+  CHECK(mfs_del(h, "a") == 0 && mfs_del(h, "b") == 0 && mfs_del(h, "c") == 0, "del all");
+  CHECK(mfs_df(h) == empty, "df after del all");
+  CHECK(mfs_undel(h, "c") == 0 && mfs_df(h) == empty - 5 * block, "df after undel c");
+  CHECK(get_same(h, "c"), "get c after undel");
+
+  // d takes every free block, a's last 2 among them, so a can't come back
+  // even though c still holds its first 3
+  make_file("d", mfs_df(h), 89);
+  CHECK(mfs_put(h, "d", NULL) == 0 && mfs_df(h) == 0, "put d filling the disk");
+  CHECK(mfs_undel(h, "a") == -1, "undel a after its blocks were taken");
+  CHECK(get_same(h, "c") && get_same(h, "d"), "get after undel a");
+  CHECK(mfs_del(h, "c") == 0 && mfs_del(h, "d") == 0 && mfs_df(h) == empty, "df after del of the rest");
+  mfs_close(h);
+}
+
+// Files are compressed in chunks of this many bytes in compress mode
+#define CHUNK_SIZE      65536
+
+// Files put in compress mode read back the same whether their chunks
+// compress or not, with sizes on either side of the chunk boundary. The
+// blocks are small so that packed chunks run across them.
+static void test_compress_round_trip() {
+  int sizes[] = { 0, 1, 1000, CHUNK_SIZE - 1, CHUNK_SIZE, CHUNK_SIZE + 1,
+    3 * CHUNK_SIZE, 3 * CHUNK_SIZE + 100 };
+  int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+  create_flag modes[] = { FS_COMPRESS, FS_COMPRESS | FS_DEDUP };
+  mfs_geometry geometry = { 1024, 20000, 200 };
+
+  // Chunks that compress and chunks that don't in the same file
+  make_file("text", CHUNK_SIZE + 500, 1);
+  make_file("noise", CHUNK_SIZE, 88);
+  copy_local("text", "mixed", -1);
+  long noise_size;
+  uint8_t *noise = read_local("noise", &noise_size);
+  int fd = open("mixed", O_WRONLY | O_APPEND);
+  CHECK(write(fd, noise, noise_size) == noise_size && write(fd, noise, 700) == 700, "make mixed");
+  close(fd);
+  free(noise);
+
+  for(int m = 0; m < 2; m++) {
+    mfs_t *h = new_image(modes[m], &geometry);
+    char name[32];
+    for(int i = 0; i < num_sizes; i++) {
+      for(int seed = 2; seed <= 87; seed += 85) {
+        sprintf(name, "%s%d", seed < 16 ? "text" : "noise", sizes[i]);
+        make_file(name, sizes[i], seed);
+        CHECK(mfs_put(h, name, NULL) == 0, "put %s in mode %d", name, modes[m]);
+      }
+    }
+    CHECK(mfs_put(h, "mixed", NULL) == 0, "put mixed in mode %d", modes[m]);
+
+    // Data that compresses well takes much less space than it would as is
+    make_file("bigtext", 8 * CHUNK_SIZE, 3);
+    long before = mfs_df(h);
+    CHECK(mfs_put(h, "bigtext", NULL) == 0, "put bigtext in mode %d", modes[m]);
+    CHECK(before - mfs_df(h) < 8 * CHUNK_SIZE / 2, "bigtext compressed in mode %d", modes[m]);
+
+    // Both after the put and once read back in from the image
+    for(int pass = 0; pass < 2; pass++) {
+      for(int i = 0; i < num_sizes; i++) {
+        for(int seed = 2; seed <= 87; seed += 85) {
+          sprintf(name, "%s%d", seed < 16 ? "text" : "noise", sizes[i]);
+          CHECK(get_same(h, name), "get %s in mode %d pass %d", name, modes[m], pass);
+        }
+      }
+      CHECK(get_same(h, "mixed") && get_same(h, "bigtext"), "get mixed and bigtext in mode %d pass %d", modes[m], pass);
+      CHECK(mfs_scrub(h) == 0, "scrub in mode %d pass %d", modes[m], pass);
+
+      mfs_savefs(h);
+      mfs_close(h);
+      h = mfs_open(IMAGE_NAME, 0);
+    }
+    mfs_close(h);
+  }
+}
+
+// A file put into free space broken up into single blocks takes an extent
+// for each block. A tree of depth 1 has at most 4 leaves under its root in
+// the inode, each holding 63 extents in 1024 byte blocks, so a file with
+// more extents than that grows the tree another level, and its tree takes
+// more than 4 blocks.
+static void test_extent_tree_depth() {
+  long block = 1024;
+  mfs_geometry geometry = { block, 2000, 700 };
+  mfs_t *h = new_image(0, &geometry);
+  make_file("one", block, 87);
+
+  // Fill the image with single block files and free every other one. The
+  // leaves of the directory that are emptied by dropping deleted entries
+  // are freed along with them.
+  int num_small = 600;
+  char name[32];
+  for(int i = 0; i < num_small; i++) {
+    sprintf(name, "f%d", i);
+    CHECK(mfs_put(h, "one", name) == 0, "put %s", name);
+  }
+  make_file("rest", mfs_df(h), 86);
+  CHECK(mfs_put(h, "rest", NULL) == 0 && mfs_df(h) == 0, "put rest filling the disk");
+  for(int i = 0; i < num_small; i += 2) {
+    sprintf(name, "f%d", i);
+    CHECK(mfs_del(h, name) == 0, "del %s", name);
+  }
+  long holes = mfs_df(h);
+  CHECK(holes >= num_small / 2 * block, "df after freeing every other block");
+
+  long data_blocks = holes / block - 10;
+  make_file("big", data_blocks * block, 85);
+  CHECK(mfs_put(h, "big", NULL) == 0, "put big");
+  CHECK(holes - mfs_df(h) >= (data_blocks + 5) * block, "extent tree of big grew past depth 1");
+  CHECK(get_same(h, "big") && get_same(h, "rest"), "get of big");
+  CHECK(mfs_scrub(h) == 0, "scrub");
+
+  CHECK(mfs_savefs(h) == 0, "save");
+  mfs_close(h);
+  h = mfs_open(IMAGE_NAME, 0);
+  CHECK(h != NULL && get_same(h, "big"), "get of big after reopening");
+
+  // Deleting big gives back the blocks of its tree along with its data,
+  // and undeleting it takes them all back
+  CHECK(mfs_del(h, "big") == 0 && mfs_df(h) == holes, "df after del big");
+  CHECK(mfs_undel(h, "big") == 0 && get_same(h, "big"), "undel big");
+  CHECK(mfs_del(h, "big") == 0 && mfs_df(h) == holes, "df after del big again");
+  mfs_close(h);
+}
+
+// Return true if getting the file d/name out of h gives the same data as the
+// local file name
+static bool get_same_in(mfs_t *h, char *name) {
+  char path[64];
+  sprintf(path, "d/%s", name);
+  unlink("got");
+  return mfs_get(h, path, "got") == 0 && same_file("got", name);
+}
+
+// A directory of many files splits into a B+tree more than one index node
+// wide, as only 3 dir entries fit in a 1024 byte block and 127 index
+// entries. Deleting most of them drops all but the last few deleted
+// entries, which frees the leaves emptied along the way, while the files
+// left are still found.
+static void test_dir_tree_prune() {
+  long block = 1024;
+  mfs_geometry geometry = { block, 6000, 2100 };
+  mfs_t *h = new_image(0, &geometry);
+  long empty = mfs_df(h);
+  CHECK(mfs_mkdir(h, "d") == 0, "mkdir d");
+  long dir_made = mfs_df(h);
+
+  // The files are inline, so the directory is all they take up
+  int num_files = 2000;
+  char name[32], path[64];
+  for(int i = 0; i < num_files; i++) {
+    sprintf(name, "f%d", i);
+    sprintf(path, "d/%s", name);
+    make_file(name, 100, 16 + i);
+    CHECK(mfs_put(h, name, path) == 0, "put %s", path);
+  }
+  long full = mfs_df(h);
+  CHECK(dir_made - full > 127 * block, "directory took more leaves than one index node holds");
+  CHECK(mfs_list(h, "d", false) == 0, "list d");
+
+  // Delete two files of every three, so the directory goes far past the
+  // most deleted entries it keeps
+  for(int i = 0; i < num_files; i++) {
+    sprintf(path, "d/f%d", i);
+    if(i % 3 != 0)
+      CHECK(mfs_del(h, path) == 0, "del %s", path);
+  }
+  CHECK(mfs_df(h) > full, "df after deleting files");
+  CHECK(mfs_savefs(h) == 0, "save");
+  mfs_close(h);
+  h = mfs_open(IMAGE_NAME, 0);
+  CHECK(h != NULL, "open after deleting files");
+
+  int kept = 0;
+  for(int i = 0; i < num_files; i++) {
+    sprintf(name, "f%d", i);
+    sprintf(path, "d/%s", name);
+    if(i % 3 == 0) {
+      CHECK(get_same_in(h, name), "get %s", path);
+    } else if(mfs_undel(h, path) == 0) {
+      CHECK(get_same_in(h, name), "get %s after undel", path);
+      kept++;
+    } else {
+      CHECK(mfs_get(h, path, "got") == -1, "get %s after failed undel", path);
+    }
+  }
+  CHECK(kept >= 32 && kept <= 64, "%d deleted entries kept", kept);
+
+  // A name whose entry was dropped can be used again
+  for(int i = 1; i < num_files; i += 3) {
+    sprintf(name, "f%d", i);
+    sprintf(path, "d/%s", name);
+    if(mfs_get(h, path, "got") == -1) {
+      CHECK(mfs_put(h, name, path) == 0 && get_same_in(h, name), "put %s again", path);
+      break;
+    }
+  }
+
+  // Once every file is gone the directory only keeps the nodes holding the
+  // last deleted entries, at most a leaf and an index node for each, and
+  // removing it gives back every block of its tree
+  for(int i = 0; i < num_files; i++) {
+    sprintf(path, "d/f%d", i);
+    mfs_del(h, path);
+  }
+  CHECK(dir_made - mfs_df(h) <= 2 * 64 * block, "df after deleting every file");
+  CHECK(mfs_rmdir(h, "d") == 0 && mfs_df(h) == empty, "df after rmdir d");
+  mfs_close(h);
+}
+
+// Remove a file or directory found by nftw
+static int remove_path(const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+  return remove(path);
+}
+
+int main(int argc, char *argv[]) {
+  char dir_name[] = "/tmp/mfs_test.XXXXXX";
+  if(mkdtemp(dir_name) == NULL || chdir(dir_name) == -1) {
+    perror("test");
+    return 1;
+  }
+  signal(SIGALRM, stalled);
+
+  // The filesystem reports every operation on stdout and stderr, which
+  // would drown out the results
+  fflush(stdout);
+  results = fdopen(dup(STDOUT_FILENO), "w");
+  setvbuf(results, NULL, _IONBF, 0);
+  freopen("/dev/null", "w", stdout);
+  freopen("/dev/null", "w", stderr);
+
+  struct {
+    const char *name;
+    void (*run)();
+  } tests[] = {
+    { "del_during_get", test_del_during_get },
+    { "del_during_getall", test_del_during_getall },
+    { "journal_replay", test_journal_replay },
+    { "dedup_refcounts", test_dedup_refcounts },
+    { "compress_round_trip", test_compress_round_trip },
+    { "extent_tree_depth", test_extent_tree_depth },
+    { "dir_tree_prune", test_dir_tree_prune },
+  };
+  int num_tests = sizeof(tests) / sizeof(tests[0]);
+  int failed = 0;
+  for(int i = 0; i < num_tests; i++) {
+    test_name = tests[i].name;
+    test_failed = false;
+    tests[i].run();
+    failed += test_failed;
+  }
+  fprintf(results, "%d of %d tests passed\n", num_tests - failed, num_tests);
+
+  chdir("/");
+  nftw(dir_name, remove_path, 16, FTW_DEPTH | FTW_PHYS);
+  return failed;
+}